@@ -1,17 +1,28 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
 #include <htslib/vcf.h>
+#include <htslib/kstring.h>
+#include "HGSC_common.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
 
 //len(PASS, FAIL, NVAR, NDAT, NFLT) = 5
-#define NUM_FILTER_STRINGS 5
+#define NUM_FILTER_STRINGS HGSC_FT_NUM
 //similarly for genotypes
 #define NUM_GT_STRINGS 6
 
-#define INDEX_PASS 0
-#define INDEX_FAIL 1
-#define INDEX_NVAR 2
-#define INDEX_NDAT 3
-#define INDEX_NFLT 4
+// filter indices are the FT classes from HGSC_common.h
+#define INDEX_PASS HGSC_FT_PASS
+#define INDEX_FAIL HGSC_FT_FAIL
+#define INDEX_NVAR HGSC_FT_NVAR
+#define INDEX_NDAT HGSC_FT_NDAT
+#define INDEX_NFLT HGSC_FT_NFLT
 
 #define INDEX_MISS 0
 #define INDEX_0 1
@@ -20,8 +31,65 @@
 #define INDEX_3 4
 #define INDEX_N 5
 
+// buckets[filt][gt1][gt2] flattened, which is what the counting kernels work on
+#define NUM_BUCKETS (NUM_FILTER_STRINGS * NUM_GT_STRINGS * NUM_GT_STRINGS)
+
+// --sparse keys: the FT class, then allele1 + 1 and allele2 + 1 (0 for missing) in SPARSE_ALLELE_BITS each, which
+// holds any allele a GT value can encode. Keys sort in the same order as the dense buckets.
+#define SPARSE_ALLELE_BITS 30
+#define SPARSE_ALLELE_MASK ((1ULL << SPARSE_ALLELE_BITS) - 1)
+#define SPARSE_MIN_SLOTS 64
+
+// The full set of samples, or one --subset of them, and the INFO tags its counts go into.
+typedef struct
+{
+    char *suffix;  // NUMSAMPLES part of the tag names
+    int named;  // suffix is a NAME from --subset NAME=FILE rather than the sample count
+    int *samples;  // header indices of the samples in the set, NULL for the full set
+    int n;
+    int tag_ids[NUM_BUCKETS];  // header ID of each FILTER_GENOTYPE_SUFFIX tag, in bucket order
+    int keys_tag_id;  // --sparse: header IDs of GTC_KEYS_SUFFIX and GTC_COUNTS_SUFFIX instead
+    int counts_tag_id;
+} sample_set_t;
+
+// --sparse counts of one set at one record: an open-addressing table of the keys seen, which stays small because most
+// sites have only a handful of distinct FT and GT combinations
+typedef struct
+{
+    uint64_t *keys;
+    int *counts;  // 0 marks an empty slot
+    int *used;  // the slots taken, so clearing the table costs the number of keys rather than its size
+    int nused;
+    int size;  // a power of two, at least twice nused
+} sparse_table_t;
+
+typedef struct
+{
+    uint64_t key;
+    int count;
+} sparse_cell_t;
+
 int nsamples;
+int min_depth;  // --min-depth: fill in FT and GT the way HGSC_filt_w_dotdots does before counting, -1 if not given
 bcf_hdr_t *header;
+hgsc_decode_t decode;
+sample_set_t *sets;  // the full set first, then each --subset in the order given
+int nsets;
+uint8_t *bucket_indices;  // flat bucket of each sample in the current record
+int sparse;  // --sparse: count every allele into GTC_KEYS/GTC_COUNTS tags instead of the bucket tags
+uint64_t *sample_keys;  // --sparse: key of each sample in the current record
+sparse_table_t table;
+sparse_cell_t *cells;  // --sparse: the populated keys of the table, sorted for output
+int num_cells;
+kstring_t keys_str;  // --sparse: GTC_KEYS value being built
+int32_t *key_counts;  // --sparse: GTC_COUNTS value being built
+hgsc_stats_t stats;  // --stats, see HGSC_stats.h
+// Fill out[i] with the flat bucket of sample i, i.e. the offset of buckets[filt][gt1][gt2], reading the first two GT
+// values of each sample from gt_data, which has `ploidy` values per sample at the packed width of the kernel.
+typedef void (*bucket_kernel_t)(const void *gt_data, int ploidy, const uint8_t *ft_codes, int n, uint8_t *out);
+bucket_kernel_t bucket_kernel_int8;  // the widest diploid kernel this CPU supports, for each GT width
+bucket_kernel_t bucket_kernel_int16;
+bucket_kernel_t bucket_kernel_int32;
 char *filter_strings[] = {"PASS", "FAIL", "NVAR", "NDAT", "NFLT"};
 char *genotype_strings[] = {".", "0", "1", "2", "3", "N"};  // N represents any other non-missing allele. We chose to
                                                             // implement this way in order to be able to put all tags in
@@ -30,6 +98,432 @@ char *genotype_strings[] = {".", "0", "1", "2", "3", "N"};  // N represents any
                                                             // than 4 alleles are pretty rare.
 
 
+/*
+ *     Genotype index of a single GT value: missing or vector_end -> INDEX_MISS, alleles 0-3 -> INDEX_0-INDEX_3,
+ *     higher alleles -> INDEX_N. bcf_gt_allele() is (gt >> 1) - 1 and the indices are allele + 1, so this is just
+ *     gt >> 1 clamped to [INDEX_MISS, INDEX_N].
+ *     */
+static inline int gt_index(int32_t gt)
+{
+    int idx = gt >> 1;
+    return idx < INDEX_MISS ? INDEX_MISS : (idx > INDEX_N ? INDEX_N : idx);
+}
+
+// bucket_indices_scalar_<width>_<ploidy>: a haploid sample, in a haploid record or padded with vector_end, is counted
+// as if both alleles were the one it has, e.g. "1" as 1/1. Only the _n instances read the ploidy argument; the others
+// have it as a constant.
+#define BUCKET_INDICES_SCALAR(suffix, gt_t, ploidy) \
+static void bucket_indices_scalar_##suffix(const void *gt_data, int p, const uint8_t *ft_codes, int n, uint8_t *out) \
+{ \
+    const gt_t *gt = gt_data; \
+    const int stride = ploidy != HGSC_PLOIDY_ANY ? ploidy : p; \
+    int i; \
+    for (i = 0; i < n; i++) \
+    { \
+        int idx1 = gt_index(gt[(size_t) stride*i + 0]); \
+        int idx2 = stride > 1 && gt[(size_t) stride*i + 1] != HGSC_VECTOR_END(gt_t) \
+                   ? gt_index(gt[(size_t) stride*i + 1]) : idx1; \
+        out[i] = (ft_codes[i] * NUM_GT_STRINGS + idx1) * NUM_GT_STRINGS + idx2; \
+    } \
+}
+HGSC_FOR_EACH_WIDTH_PLOIDY(BUCKET_INDICES_SCALAR)
+
+#ifdef HAVE_X86_KERNELS
+// The SIMD kernels are diploid only, and count a haploid call padded with vector_end like the scalar ones, as if both
+// alleles were the one it has. They read GT at its packed width and sign-extend it to int32 in registers, so int8 and
+// int16 records cost a quarter and a half of the loads an int32 copy would.
+
+// 2 samples (4 GT values) as int32
+__attribute__((target("sse4.1"))) static inline __m128i load_gt4_int8(const int8_t *gt)
+{
+    int32_t v;
+    memcpy(&v, gt, 4);
+    return _mm_cvtepi8_epi32(_mm_cvtsi32_si128(v));
+}
+
+__attribute__((target("sse4.1"))) static inline __m128i load_gt4_int16(const int16_t *gt)
+{
+    return _mm_cvtepi16_epi32(_mm_loadl_epi64((const __m128i *) gt));
+}
+
+__attribute__((target("sse4.1"))) static inline __m128i load_gt4_int32(const int32_t *gt)
+{
+    return _mm_loadu_si128((const __m128i *) gt);
+}
+
+// 4 samples (8 GT values) as int32
+__attribute__((target("avx2"))) static inline __m256i load_gt8_int8(const int8_t *gt)
+{
+    return _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *) gt));
+}
+
+__attribute__((target("avx2"))) static inline __m256i load_gt8_int16(const int16_t *gt)
+{
+    return _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *) gt));
+}
+
+__attribute__((target("avx2"))) static inline __m256i load_gt8_int32(const int32_t *gt)
+{
+    return _mm256_loadu_si256((const __m256i *) gt);
+}
+
+// Genotype indices idx of the GT values gt, with each second allele that is a vector_end pad replaced by the index of
+// the first. A first value that is vector_end has index INDEX_MISS already, so its sample stays ./. .
+__attribute__((target("sse4.1"))) static inline __m128i haploid_sse41(__m128i gt, __m128i idx, __m128i vector_end)
+{
+    __m128i first = _mm_shuffle_epi32(idx, _MM_SHUFFLE(2, 2, 0, 0));
+    return _mm_blendv_epi8(idx, first, _mm_cmpeq_epi32(gt, vector_end));
+}
+
+__attribute__((target("avx2"))) static inline __m256i haploid_avx2(__m256i gt, __m256i idx, __m256i vector_end)
+{
+    __m256i first = _mm256_shuffle_epi32(idx, _MM_SHUFFLE(2, 2, 0, 0));
+    return _mm256_blendv_epi8(idx, first, _mm256_cmpeq_epi32(gt, vector_end));
+}
+
+// bucket_indices_sse41_int8/_int16/_int32: 4 samples per iteration
+#define BUCKET_INDICES_SSE41(width, gt_t) \
+__attribute__((target("sse4.1"))) \
+static void bucket_indices_sse41_##width(const void *gt_data, int ploidy, const uint8_t *ft_codes, int n, uint8_t *out) \
+{ \
+    const gt_t *gt = gt_data; \
+    const __m128i lo = _mm_set1_epi32(INDEX_MISS); \
+    const __m128i hi = _mm_set1_epi32(INDEX_N); \
+    const __m128i gt_weights = _mm_setr_epi32(NUM_GT_STRINGS, 1, NUM_GT_STRINGS, 1); \
+    const __m128i filt_weight = _mm_set1_epi32(NUM_GT_STRINGS * NUM_GT_STRINGS); \
+    const __m128i vector_end = _mm_set1_epi32(HGSC_VECTOR_END(gt_t)); \
+ \
+    int i; \
+    for (i = 0; i + 4 <= n; i += 4) \
+    { \
+        __m128i ga = load_gt4_##width(gt + 2*i);      /* samples 0, 1 */ \
+        __m128i gb = load_gt4_##width(gt + 2*i + 4);  /* samples 2, 3 */ \
+        __m128i a = haploid_sse41(ga, _mm_min_epi32(_mm_max_epi32(_mm_srai_epi32(ga, 1), lo), hi), vector_end); \
+        __m128i b = haploid_sse41(gb, _mm_min_epi32(_mm_max_epi32(_mm_srai_epi32(gb, 1), lo), hi), vector_end); \
+        a = _mm_mullo_epi32(a, gt_weights); \
+        b = _mm_mullo_epi32(b, gt_weights); \
+        __m128i idx = _mm_hadd_epi32(a, b);  /* gt1 * 6 + gt2 for samples 0-3 */ \
+ \
+        int32_t ft4; \
+        memcpy(&ft4, ft_codes + i, 4); \
+        idx = _mm_add_epi32(idx, _mm_mullo_epi32(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(ft4)), filt_weight)); \
+ \
+        idx = _mm_packus_epi32(idx, idx); \
+        idx = _mm_packus_epi16(idx, idx); \
+        ft4 = _mm_cvtsi128_si32(idx); \
+        memcpy(out + i, &ft4, 4); \
+    } \
+    bucket_indices_scalar_##width##_2(gt + 2*i, 2, ft_codes + i, n - i, out + i); \
+}
+HGSC_FOR_EACH_WIDTH(BUCKET_INDICES_SSE41)
+
+// bucket_indices_avx2_int8/_int16/_int32: 8 samples per iteration
+#define BUCKET_INDICES_AVX2(width, gt_t) \
+__attribute__((target("avx2"))) \
+static void bucket_indices_avx2_##width(const void *gt_data, int ploidy, const uint8_t *ft_codes, int n, uint8_t *out) \
+{ \
+    const gt_t *gt = gt_data; \
+    const __m256i lo = _mm256_set1_epi32(INDEX_MISS); \
+    const __m256i hi = _mm256_set1_epi32(INDEX_N); \
+    const __m256i gt_weights = _mm256_setr_epi32(NUM_GT_STRINGS, 1, NUM_GT_STRINGS, 1, \
+                                                 NUM_GT_STRINGS, 1, NUM_GT_STRINGS, 1); \
+    const __m256i filt_weight = _mm256_set1_epi32(NUM_GT_STRINGS * NUM_GT_STRINGS); \
+    const __m256i vector_end = _mm256_set1_epi32(HGSC_VECTOR_END(gt_t)); \
+ \
+    int i; \
+    for (i = 0; i + 8 <= n; i += 8) \
+    { \
+        __m256i ga = load_gt8_##width(gt + 2*i);      /* samples 0-3 */ \
+        __m256i gb = load_gt8_##width(gt + 2*i + 8);  /* samples 4-7 */ \
+        __m256i a = haploid_avx2(ga, _mm256_min_epi32(_mm256_max_epi32(_mm256_srai_epi32(ga, 1), lo), hi), \
+                                 vector_end); \
+        __m256i b = haploid_avx2(gb, _mm256_min_epi32(_mm256_max_epi32(_mm256_srai_epi32(gb, 1), lo), hi), \
+                                 vector_end); \
+        a = _mm256_mullo_epi32(a, gt_weights); \
+        b = _mm256_mullo_epi32(b, gt_weights); \
+        /* hadd works within 128-bit lanes, giving samples 0 1 4 5 | 2 3 6 7; put them back in order */ \
+        __m256i idx = _mm256_permute4x64_epi64(_mm256_hadd_epi32(a, b), _MM_SHUFFLE(3, 1, 2, 0)); \
+ \
+        __m128i ft8 = _mm_loadl_epi64((const __m128i *) (ft_codes + i)); \
+        idx = _mm256_add_epi32(idx, _mm256_mullo_epi32(_mm256_cvtepu8_epi32(ft8), filt_weight)); \
+ \
+        __m128i packed = _mm_packus_epi32(_mm256_castsi256_si128(idx), _mm256_extracti128_si256(idx, 1)); \
+        _mm_storel_epi64((__m128i *) (out + i), _mm_packus_epi16(packed, packed)); \
+    } \
+    bucket_indices_sse41_##width(gt + 2*i, 2, ft_codes + i, n - i, out + i); \
+}
+HGSC_FOR_EACH_WIDTH(BUCKET_INDICES_AVX2)
+#endif
+
+/*
+ *     Pick the widest bucket index kernels this CPU supports.
+ *     */
+static void select_bucket_kernel(void)
+{
+    bucket_kernel_int8 = bucket_indices_scalar_int8_2;
+    bucket_kernel_int16 = bucket_indices_scalar_int16_2;
+    bucket_kernel_int32 = bucket_indices_scalar_int32_2;
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        bucket_kernel_int8 = bucket_indices_avx2_int8;
+        bucket_kernel_int16 = bucket_indices_avx2_int16;
+        bucket_kernel_int32 = bucket_indices_avx2_int32;
+    }
+    else if (__builtin_cpu_supports("sse4.1"))
+    {
+        bucket_kernel_int8 = bucket_indices_sse41_int8;
+        bucket_kernel_int16 = bucket_indices_sse41_int16;
+        bucket_kernel_int32 = bucket_indices_sse41_int32;
+    }
+#endif
+}
+
+/*
+ *     Fill out[i] with the flat bucket of sample i from the packed GT in gt, or as ./. if the record has no GT.
+ *     */
+static void compute_bucket_indices(const hgsc_fmt_view_t *gt, const uint8_t *ft_codes, int n, uint8_t *out)
+{
+    int i;
+    if (gt == NULL)
+    {
+        for (i = 0; i < n; i++)
+            out[i] = (ft_codes[i] * NUM_GT_STRINGS + INDEX_MISS) * NUM_GT_STRINGS + INDEX_MISS;
+    }
+    else if (gt->n == 2)
+        HGSC_VIEW_DISPATCH(gt, bucket_kernel, gt->p, 2, ft_codes, n, out);
+    else  // haploid or polyploid: gt->n is never 2 here
+        HGSC_GT_DISPATCH(gt, bucket_indices_scalar, gt->p, gt->n, ft_codes, n, out);
+}
+
+/*
+ *     Count bucket indices into counts[NUM_BUCKETS]. Spreads consecutive samples over four sub-histograms so runs of
+ *     samples in the same bucket (most of them, at most sites) don't stall on a single counter.
+ *     */
+static void count_bucket_indices(const uint8_t *indices, int n, int *counts)
+{
+    int sub[4][NUM_BUCKETS];
+    memset(sub, 0, sizeof(sub));
+
+    int i;
+    for (i = 0; i + 4 <= n; i += 4)
+    {
+        sub[0][indices[i + 0]]++;
+        sub[1][indices[i + 1]]++;
+        sub[2][indices[i + 2]]++;
+        sub[3][indices[i + 3]]++;
+    }
+    for (; i < n; i++)
+        sub[0][indices[i]]++;
+
+    for (i = 0; i < NUM_BUCKETS; i++)
+        counts[i] = sub[0][i] + sub[1][i] + sub[2][i] + sub[3][i];
+}
+
+/*
+ *     Count the bucket indices of just the samples in a subset into counts[NUM_BUCKETS].
+ *     */
+static void count_subset_indices(const uint8_t *indices, const int *samples, int n, int *counts)
+{
+    int sub[4][NUM_BUCKETS];
+    memset(sub, 0, sizeof(sub));
+
+    int i;
+    for (i = 0; i + 4 <= n; i += 4)
+    {
+        sub[0][indices[samples[i + 0]]]++;
+        sub[1][indices[samples[i + 1]]]++;
+        sub[2][indices[samples[i + 2]]]++;
+        sub[3][indices[samples[i + 3]]]++;
+    }
+    for (; i < n; i++)
+        sub[0][indices[samples[i]]]++;
+
+    for (i = 0; i < NUM_BUCKETS; i++)
+        counts[i] = sub[0][i] + sub[1][i] + sub[2][i] + sub[3][i];
+}
+
+static inline uint64_t sparse_key(int ft_code, int all1, int all2)
+{
+    uint64_t a1 = all1 < 0 ? 0 : all1 + 1;
+    uint64_t a2 = all2 < 0 ? 0 : all2 + 1;
+    return ((uint64_t) ft_code << (2 * SPARSE_ALLELE_BITS)) | (a1 << SPARSE_ALLELE_BITS) | a2;
+}
+
+// sparse_keys_<width>_<ploidy>: the --sparse key of each sample, reading GT at its packed width
+#define SPARSE_KEYS(suffix, gt_t, ploidy) \
+static void sparse_keys_##suffix(const hgsc_fmt_view_t *gt, const uint8_t *ft_codes, int n, uint64_t *out) \
+{ \
+    int i; \
+    for (i = 0; i < n; i++) \
+        out[i] = sparse_key(ft_codes[i], HGSC_GT_ALLELE_P(gt_t, gt, ploidy, i, 0), \
+                            HGSC_GT_ALLELE_P(gt_t, gt, ploidy, i, 1)); \
+}
+HGSC_FOR_EACH_WIDTH_PLOIDY(SPARSE_KEYS)
+
+/*
+ *     Fill out[i] with the --sparse key of sample i from the packed GT in gt, or as ./. if the record has no GT.
+ *     */
+static void compute_sparse_keys(const hgsc_fmt_view_t *gt, const uint8_t *ft_codes, int n, uint64_t *out)
+{
+    int i;
+    if (gt == NULL)
+    {
+        for (i = 0; i < n; i++)
+            out[i] = sparse_key(ft_codes[i], -1, -1);
+    }
+    else
+    {
+        HGSC_GT_DISPATCH(gt, sparse_keys, gt, ft_codes, n, out);
+    }
+}
+
+static inline size_t sparse_hash(uint64_t key, int size)
+{
+    return (size_t) ((key * 0x9E3779B97F4A7C15ULL) >> 32) & (size - 1);
+}
+
+/*
+ *     Double the table, or allocate it the first time.
+ *     */
+static void sparse_grow(sparse_table_t *t)
+{
+    sparse_table_t old = *t;
+    t->size = old.size ? 2 * old.size : SPARSE_MIN_SLOTS;
+    t->keys = malloc(t->size * sizeof(uint64_t));
+    t->counts = calloc(t->size, sizeof(int));
+    t->used = malloc(t->size / 2 * sizeof(int));
+    if (t->keys == NULL || t->counts == NULL || t->used == NULL)
+    {
+        fprintf(stderr, "Error allocating %d sparse counters.\n", t->size);
+        exit(1);
+    }
+
+    int i;
+    t->nused = 0;
+    for (i = 0; i < old.nused; i++)
+    {
+        size_t slot = sparse_hash(old.keys[old.used[i]], t->size);
+        while (t->counts[slot] != 0)
+            slot = (slot + 1) & (t->size - 1);
+        t->keys[slot] = old.keys[old.used[i]];
+        t->counts[slot] = old.counts[old.used[i]];
+        t->used[t->nused++] = slot;
+    }
+    free(old.keys);
+    free(old.counts);
+    free(old.used);
+}
+
+/*
+ *     The slot of key, taking an empty one if key isn't in the table yet. Its count must be incremented before the
+ *     next call, which is what marks a new slot as taken.
+ *     */
+static inline size_t sparse_slot(sparse_table_t *t, uint64_t key)
+{
+    if (2 * (t->nused + 1) > t->size)
+        sparse_grow(t);
+
+    size_t slot = sparse_hash(key, t->size);
+    while (t->counts[slot] != 0 && t->keys[slot] != key)
+        slot = (slot + 1) & (t->size - 1);
+    if (t->counts[slot] == 0)
+    {
+        t->keys[slot] = key;
+        t->used[t->nused++] = slot;
+    }
+    return slot;
+}
+
+/*
+ *     Count the keys of samples[0..n), or of the first n samples if samples is NULL. Runs of samples with the same key
+ *     (most of them, at most sites) skip the lookup.
+ *     */
+static void sparse_count(sparse_table_t *t, const uint64_t *keys, const int *samples, int n)
+{
+    uint64_t last_key = 0;
+    size_t last_slot = 0;
+    int i;
+    for (i = 0; i < n; i++)
+    {
+        uint64_t key = keys[samples != NULL ? samples[i] : i];
+        if (i == 0 || key != last_key)
+        {
+            last_slot = sparse_slot(t, key);
+            last_key = key;
+        }
+        t->counts[last_slot]++;
+    }
+}
+
+static int compare_cells(const void *a, const void *b)
+{
+    uint64_t ka = ((const sparse_cell_t *) a)->key, kb = ((const sparse_cell_t *) b)->key;
+    return ka < kb ? -1 : ka > kb;
+}
+
+static void put_sparse_allele(uint64_t a, kstring_t *s)
+{
+    if (a == 0)
+        kputc('.', s);
+    else
+        kputw(a - 1, s);
+}
+
+/*
+ *     Write the --sparse counts of one set into its GTC_KEYS and GTC_COUNTS tags, in key order, and empty the table.
+ *     */
+static void put_sparse_counts(sparse_table_t *t, const sample_set_t *set, bcf1_t *rec)
+{
+    int i, n = t->nused;
+    if (n == 0)
+        return;
+    if (num_cells < n)
+    {
+        cells = realloc(cells, n * sizeof(sparse_cell_t));
+        key_counts = realloc(key_counts, n * sizeof(int32_t));
+        if (cells == NULL || key_counts == NULL)
+        {
+            fprintf(stderr, "Error allocating %d sparse counters.\n", n);
+            exit(1);
+        }
+        num_cells = n;
+    }
+    for (i = 0; i < n; i++)
+    {
+        cells[i].key = t->keys[t->used[i]];
+        cells[i].count = t->counts[t->used[i]];
+        t->counts[t->used[i]] = 0;
+    }
+    t->nused = 0;
+    qsort(cells, n, sizeof(sparse_cell_t), compare_cells);
+
+    // e.g. PASS_0/1,PASS_1/1,NDAT_./.
+    keys_str.l = 0;
+    for (i = 0; i < n; i++)
+    {
+        uint64_t key = cells[i].key;
+        if (i > 0)
+            kputc(',', &keys_str);
+        kputs(filter_strings[key >> (2 * SPARSE_ALLELE_BITS)], &keys_str);
+        kputc('_', &keys_str);
+        put_sparse_allele((key >> SPARSE_ALLELE_BITS) & SPARSE_ALLELE_MASK, &keys_str);
+        kputc('/', &keys_str);
+        put_sparse_allele(key & SPARSE_ALLELE_MASK, &keys_str);
+        key_counts[i] = cells[i].count;
+    }
+
+    const char *keys_id = bcf_hdr_int2id(header, BCF_DT_ID, set->keys_tag_id);
+    const char *counts_id = bcf_hdr_int2id(header, BCF_DT_ID, set->counts_tag_id);
+    if (bcf_update_info_string(header, rec, keys_id, keys_str.s) < 0
+        || bcf_update_info_int32(header, rec, counts_id, key_counts, n) < 0)
+    {
+        fprintf(stderr, "Error adding %s and %s:-/\n", keys_id, counts_id);
+        exit(1);
+    }
+}
+
 /*
  *     This short description is used to generate the output of `bcftools plugin -l`.
  *     */
@@ -37,18 +531,109 @@ const char *about(void)
 {
     // TODO update this to reflect limited indel functionality
     return "Add INFO subfields with counts of various FT and GT combinations.\n"
-           "Be warned that this assumes SNPs! This plugin won't work if there are more than 4 alleles in one row.\n";
+           "Be warned that this assumes SNPs! Alleles above 3 are all counted as N, unless --sparse is given.\n";
+}
+
+const char *usage(void)
+{
+    return "Usage: bcftools +HGSC_append_gtcounts GENERAL_OPTIONS INPUT.bcf -- PLUGIN_OPTIONS\n"
+           "About:\n"
+           "\tAdd INFO subfields with counts of various FT and GT combinations.\n"
+           "\t--min-depth N first fills in FT (and GT) exactly like HGSC_filt_w_dotdots with minimum depth N, then counts\n"
+           "\t    the rewritten values, so filtering and counting take one pass instead of two.\n"
+           "\t--subset [NAME=]FILE also counts just the samples listed in FILE, one per line, into tags ending in _NAME.\n"
+           "\t    NAME defaults to the number of samples in FILE, like the full set. Can be given more than once.\n"
+           "\t--sparse counts every allele, and writes just the combinations that occur: GTC_KEYS_NUMSAMPLES lists\n"
+           "\t    them, e.g. PASS_0/1,PASS_1/12, and GTC_COUNTS_NUMSAMPLES has their counts in the same order.\n"
+           "\t    These two tags per set replace the 180 FILTER_GENOTYPE_NUMSAMPLES ones.\n"
+           "\t--stats prints where the time went to stderr at the end, with a progress line every 10 seconds.\n"
+           "\t    --stats-json FILE writes the same summary to FILE as JSON.\n"
+           "bcftools +HGSC_append_gtcounts filtered.vcf\n"
+           "bcftools +HGSC_append_gtcounts input.vcf -- --min-depth 1\n"
+           "bcftools +HGSC_append_gtcounts filtered.vcf -- --subset AFR=afr.txt --subset EUR=eur.txt --subset batch1.txt\n"
+           "bcftools +HGSC_append_gtcounts multiallelic.vcf -- --sparse\n";
 }
 
 /*
- *     Called once at startup, allows to initialize local variables.
- *         Return 1 to suppress VCF/BCF header from printing, 0 otherwise.
- *         */
-int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
+ *     Add a sample set for a --subset argument, [NAME=]FILE.
+ *     */
+static int add_subset(const char *arg)
+{
+    const char *fname = arg;
+    const char *eq = strchr(arg, '=');
+    if (eq != NULL)
+        fname = eq + 1;
+
+    int n, i;
+    char **names = hts_readlist(fname, 1, &n);
+    if (names == NULL)
+    {
+        fprintf(stderr, "Could not read samples from %s\n", fname);
+        return -1;
+    }
+
+    sample_set_t *tmp = realloc(sets, (nsets + 1) * sizeof(sample_set_t));
+    if (tmp == NULL)
+    {
+        fprintf(stderr, "Error allocating sample sets.\n");
+        return -1;
+    }
+    sets = tmp;
+    sample_set_t *set = &sets[nsets++];
+    memset(set, 0, sizeof(*set));
+    set->n = n;
+    set->samples = malloc((n + 1) * sizeof(int));
+    if (set->samples == NULL)
+    {
+        fprintf(stderr, "Error allocating sample sets.\n");
+        return -1;
+    }
+    set->named = eq != NULL;
+    if (eq != NULL)
+        set->suffix = strndup(arg, eq - arg);
+    else if (asprintf(&set->suffix, "%d", n) < 0)
+    {
+        set->suffix = NULL;  // asprintf leaves it undefined
+        fprintf(stderr, "Error allocating sample sets.\n");
+        return -1;
+    }
+
+    int ret = 0;
+    for (i = 0; i < n; i++)
+    {
+        set->samples[i] = bcf_hdr_id2int(header, BCF_DT_SAMPLE, names[i]);
+        if (set->samples[i] < 0 && ret == 0)
+        {
+            fprintf(stderr, "Sample %s from %s is not in the input\n", names[i], fname);
+            ret = -1;
+        }
+        free(names[i]);
+    }
+    free(names);
+
+    if (set->suffix == NULL || set->suffix[0] == 0)
+    {
+        fprintf(stderr, "Bad --subset %s\n", arg);
+        ret = -1;
+    }
+    for (i = 0; i < nsets - 1 && ret == 0; i++)
+    {
+        if (strcmp(sets[i].suffix, set->suffix) == 0)
+        {
+            fprintf(stderr, "--subset %s would add tags ending in _%s, which are already used. Give it a NAME=.\n",
+                    arg, set->suffix);
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+/*
+ *     Add the FILTER_GENOTYPE_SUFFIX tags of a sample set to the header and remember their IDs.
+ *     */
+static int add_set_tags(sample_set_t *set)
 {
-    nsamples = bcf_hdr_nsamples(in);
-    header = out;
-  
     int ret;
     int filt_counter;
     int gt1_counter;
@@ -61,12 +646,13 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
             for (gt2_counter = 0; gt2_counter < NUM_GT_STRINGS; gt2_counter++)
             {
                 char *header_string;
-                ret = asprintf(&header_string, "##INFO=<ID=%s_%s%s_%d,Number=.,Type=Integer,Description=\"Count of "
-                                               "samples w/filter %s and genotype %s/%s in %d-sample set\">",
+                ret = asprintf(&header_string, "##INFO=<ID=%s_%s%s_%s,Number=.,Type=Integer,Description=\"Count of "
+                                               "samples w/filter %s and genotype %s/%s in %d-sample set%s%s\">",
                                filter_strings[filt_counter], genotype_strings[gt1_counter], 
-                               genotype_strings[gt2_counter], nsamples,
+                               genotype_strings[gt2_counter], set->suffix,
                                filter_strings[filt_counter], genotype_strings[gt1_counter], 
-                               genotype_strings[gt2_counter], nsamples);
+                               genotype_strings[gt2_counter], set->n,
+                               set->named ? " " : "", set->named ? set->suffix : "");
                 if (ret < 0)
                 {
                     fprintf(stderr, "Error updating header.\n");
@@ -81,6 +667,25 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
                 }
                 
                 free(header_string);
+
+                char *id_str;
+                ret = asprintf(&id_str, "%s_%s%s_%s", filter_strings[filt_counter], genotype_strings[gt1_counter],
+                               genotype_strings[gt2_counter], set->suffix);
+                if (ret < 0)
+                {
+                    fprintf(stderr, "Error updating header.\n");
+                    return -1;
+                }
+
+                int *tag_id = &set->tag_ids[(filt_counter * NUM_GT_STRINGS + gt1_counter) * NUM_GT_STRINGS + gt2_counter];
+                *tag_id = bcf_hdr_id2int(header, BCF_DT_ID, id_str);
+                if (!bcf_hdr_idinfo_exists(header, BCF_HL_INFO, *tag_id))
+                {
+                    fprintf(stderr, "Error adding %s to header.\n", id_str);
+                    return -1;
+                }
+
+                free(id_str);
             }
         }
     }
@@ -88,6 +693,146 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
     return 0;
 }
 
+/*
+ *     Add one --sparse tag from its header line and remember its ID.
+ *     */
+static int add_sparse_tag(const char *id_str, const char *header_string, int *tag_id)
+{
+    if (bcf_hdr_append(header, header_string) != 0)
+    {
+        fprintf(stderr, "Error updating header.\n");
+        return -1;
+    }
+    *tag_id = bcf_hdr_id2int(header, BCF_DT_ID, id_str);
+    if (!bcf_hdr_idinfo_exists(header, BCF_HL_INFO, *tag_id))
+    {
+        fprintf(stderr, "Error adding %s to header.\n", id_str);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ *     Add the GTC_KEYS_SUFFIX and GTC_COUNTS_SUFFIX tags that --sparse writes for a sample set instead of the
+ *     FILTER_GENOTYPE_SUFFIX ones.
+ *     */
+static int add_sparse_tags(sample_set_t *set)
+{
+    char *keys_id, *counts_id, *keys_line, *counts_line;
+    const char *space = set->named ? " " : "", *name = set->named ? set->suffix : "";
+    if (asprintf(&keys_id, "GTC_KEYS_%s", set->suffix) < 0
+        || asprintf(&counts_id, "GTC_COUNTS_%s", set->suffix) < 0
+        || asprintf(&keys_line, "##INFO=<ID=%s,Number=.,Type=String,Description=\"Filter and genotype of each count in "
+                                "%s, e.g. PASS_0/1, in %d-sample set%s%s\">", keys_id, counts_id, set->n, space,
+                    name) < 0
+        || asprintf(&counts_line, "##INFO=<ID=%s,Number=.,Type=Integer,Description=\"Count of samples w/each filter "
+                                  "and genotype in %s, in %d-sample set%s%s\">", counts_id, keys_id, set->n, space,
+                    name) < 0)
+    {
+        fprintf(stderr, "Error updating header.\n");
+        return -1;
+    }
+
+    int ret = add_sparse_tag(keys_id, keys_line, &set->keys_tag_id);
+    if (ret == 0)
+        ret = add_sparse_tag(counts_id, counts_line, &set->counts_tag_id);
+
+    free(keys_id);
+    free(counts_id);
+    free(keys_line);
+    free(counts_line);
+    return ret;
+}
+
+/*
+ *     Called once at startup, allows to initialize local variables.
+ *         Return 1 to suppress VCF/BCF header from printing, 0 otherwise.
+ *         */
+int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
+{
+    hgsc_stats_init(&stats, "HGSC_append_gtcounts", &argc, argv, in);
+    nsamples = bcf_hdr_nsamples(in);
+    header = out;
+    min_depth = -1;
+    sparse = 0;
+    decode.stats = &stats;
+
+    // the full set of samples is always counted, with the number of samples as its suffix
+    nsets = 1;
+    sets = calloc(1, sizeof(sample_set_t));
+    if (sets == NULL || asprintf(&sets[0].suffix, "%d", nsamples) < 0)
+    {
+        fprintf(stderr, "Error allocating sample sets.\n");
+        return -1;
+    }
+    sets[0].n = nsamples;
+
+    static struct option long_options[] =
+    {
+        {"help", no_argument, NULL, 'h'},
+        {"min-depth", required_argument, NULL, 'd'},
+        {"subset", required_argument, NULL, 's'},
+        {"sparse", no_argument, NULL, 'S'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    char *endptr;
+    while ((opt = getopt_long(argc, argv, "hd:s:S", long_options, NULL)) >= 0)
+    {
+        switch(opt)
+        {
+            case 'd':
+                min_depth = strtol(optarg, &endptr, 10);
+                if (*endptr || min_depth < 0)
+                {
+                    fprintf(stderr, "Could not parse --min-depth %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 's':
+                if (add_subset(optarg) != 0)
+                    return -1;
+                break;
+            case 'S': sparse = 1; break;
+            default: fprintf(stderr, "%s", usage()); return -1;
+        }
+    }
+
+    if (min_depth >= 0 && hgsc_decode_new_ft(&decode, nsamples) == NULL)
+    {
+        fprintf(stderr, "Could not allocate FT buffer for %d samples.\n", nsamples);
+        return -1;
+    }
+
+    select_bucket_kernel();
+    if (sparse)
+        sample_keys = malloc((nsamples + 1) * sizeof(uint64_t));
+    else
+        bucket_indices = malloc(nsamples + 1);
+    if (sparse ? sample_keys == NULL : bucket_indices == NULL)
+    {
+        fprintf(stderr, "Error allocating bucket indices.\n");
+        return -1;
+    }
+  
+    int i;
+    for (i = 0; i < nsets; i++)
+    {
+        if ((sparse ? add_sparse_tags(&sets[i]) : add_set_tags(&sets[i])) != 0)
+            return -1;
+    }
+
+    // make the new tags visible to bcf_hdr_int2id()
+    if (bcf_hdr_sync(header) != 0)
+    {
+        fprintf(stderr, "Error updating header.\n");
+        return -1;
+    }
+
+    hgsc_stats_lap(&stats, HGSC_PHASE_SETUP);
+    return 0;
+}
+
 
 /*
  *     Called for each VCF record. Return rec to output the line or NULL
@@ -95,100 +840,82 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
  *         */
 bcf1_t *process(bcf1_t *rec)
 {
+    hgsc_stats_lap(&stats, HGSC_PHASE_BCFTOOLS);
+    hgsc_stats_record(&stats, rec->rid, rec->pos);
     int num_returned;
 
-    char **filter_data = NULL;
-    int32_t num_filter_data = 0;
-    num_returned = bcf_get_format_string(header, rec, "FT", &filter_data, &num_filter_data);
+    num_returned = hgsc_decode_ft_codes(&decode, header, rec, nsamples);
+    uint8_t *ft_codes = decode.ft_codes;
 
-    int32_t *gt_data = NULL;
-    int32_t num_gt_data = 0;
-    num_returned = bcf_get_genotypes(header, rec, &gt_data, &num_gt_data);
+    if (min_depth >= 0 && hgsc_any_ft(&decode, nsamples, HGSC_FT_BIT(HGSC_FT_NFLT)))
+    {
+        // filling in FT needs GT and DP as plain int32 values to edit
+        num_returned = hgsc_decode_gt(&decode, header, rec);
+        int32_t *gt_data = decode.gt_data;
+        int num_gt_data = num_returned;
+        // only needed to fill in a "." FT; without DP, decode.has_depth is cleared and every DP reads as missing
+        hgsc_decode_dp(&decode, header, rec);
+        // updates gt_data and ft_codes to match the new FT; nothing to write back if every sample already had one
+        int nfilled = hgsc_fill_ft(&decode, nsamples, min_depth);
+        hgsc_stats_lap(&stats, HGSC_PHASE_COUNT);
+        if (nfilled > 0)
+        {
+            bcf_update_format_string(header, rec, "FT", decode.new_filter_data, nsamples);
+            bcf_update_genotypes(header, rec, gt_data, num_gt_data);
+            hgsc_stats_lap(&stats, HGSC_PHASE_UPDATE);
+        }
+    }
 
     //char *filter_string;  //one of PASS, FAIL, NVAR, NDAT
     //char* gt_string;    //one of .., .0, .1, 00, 01, or 11 for ./., ./0, ./1, 0/0, etc 
 
     int buckets[NUM_FILTER_STRINGS][NUM_GT_STRINGS][NUM_GT_STRINGS];
-    int i, j, k;
-    for (i = 0; i < NUM_FILTER_STRINGS; i++)
-        for (j = 0; j < NUM_GT_STRINGS; j++)
-            for (k = 0; k < NUM_GT_STRINGS; k++)
-                buckets[i][j][k] = 0;
-
-    int filt_index;
-    int gt1_index;
-    int gt2_index;
-
-    for (i = 0; i < nsamples; i++)
-    {
-        int all1 = bcf_gt_allele(gt_data[2*i + 0]);
-        int all2 = bcf_gt_allele(gt_data[2*i + 1]);
-
-        //CHECK FILTER
-        if(strcmp(filter_data[i], "PASS") == 0)
-            filt_index = INDEX_PASS;
-        else if(strcmp(filter_data[i], "No_var") == 0)
-            filt_index = INDEX_NVAR;
-        else if(strcmp(filter_data[i], "No_data") == 0)
-            filt_index = INDEX_NDAT;
-        else if(strcmp(filter_data[i], ".") == 0)
-            filt_index = INDEX_NFLT;
-        else
-            filt_index = INDEX_FAIL;
-
-        //CHECK GT
-        if (all1 < 0)
-            gt1_index = INDEX_MISS;
-        if (all1 == 0)
-            gt1_index = INDEX_0;
-        if (all1 == 1)
-            gt1_index = INDEX_1;
-        if (all1 == 2)
-            gt1_index = INDEX_2;
-        if (all1 == 3)
-            gt1_index = INDEX_3;
-        if (all1 > 3)
-            gt1_index = INDEX_N;
-        
-        if (all2 < 0)
-            gt2_index = INDEX_MISS;
-        if (all2 == 0)
-            gt2_index = INDEX_0;
-        if (all2 == 1)
-            gt2_index = INDEX_1;
-        if (all2 == 2)
-            gt2_index = INDEX_2;
-        if (all2 == 3)
-            gt2_index = INDEX_3;
-        if (all2 > 3)
-            gt2_index = INDEX_N;
-
-        buckets[filt_index][gt1_index][gt2_index]++;
-    }
-
-    for (i = 0; i < NUM_FILTER_STRINGS; i++)
-        for (j = 0; j < NUM_GT_STRINGS; j++)
-            for (k = 0; k < NUM_GT_STRINGS; k++)
-            {
-                if (buckets[i][j][k] == 0)
-                    continue;        
-    
-                char *id_str = NULL;
-                int ret = asprintf(&id_str, "%s_%s%s_%d", 
-                                   filter_strings[i], genotype_strings[j], genotype_strings[k], nsamples);
+    int i, j;
 
-                if (ret < 0 || bcf_update_info_int32(header, rec, id_str, &buckets[i][j][k], 1) < 0) 
-                {
-                    fprintf(stderr, "Error adding %s:-/\n", id_str); 
-                    exit(1); 
-                }
+    // every sample's bucket is worked out once, straight from the packed GT (after any rewrite above); each set then
+    // just histograms its own samples' buckets
+    int has_gt = hgsc_decode_fields(&decode, header, rec, nsamples, HGSC_FIELD_GT_VIEW) & HGSC_FIELD_GT_VIEW;
 
-                free(id_str);
-            } 
+    if (sparse)
+    {
+        compute_sparse_keys(has_gt ? &decode.gt_view : NULL, ft_codes, nsamples, sample_keys);
+        for (j = 0; j < nsets; j++)
+        {
+            sparse_count(&table, sample_keys, sets[j].samples, sets[j].n);
+            hgsc_stats_lap(&stats, HGSC_PHASE_COUNT);
+            put_sparse_counts(&table, &sets[j], rec);
+            hgsc_stats_lap(&stats, HGSC_PHASE_UPDATE);
+        }
+        return rec;
+    }
+
+    compute_bucket_indices(has_gt ? &decode.gt_view : NULL, ft_codes, nsamples, bucket_indices);
 
-    free(filter_data[0]);
-    free(filter_data);
-    free(gt_data);
+    for (j = 0; j < nsets; j++)
+    {
+        if (sets[j].samples == NULL)
+            count_bucket_indices(bucket_indices, nsamples, &buckets[0][0][0]);
+        else
+            count_subset_indices(bucket_indices, sets[j].samples, sets[j].n, &buckets[0][0][0]);
+        hgsc_stats_lap(&stats, HGSC_PHASE_COUNT);
+
+        // one pass over the flattened table, in the same order as the tags were added to the header
+        const int *counts = &buckets[0][0][0];
+        const int *ids = sets[j].tag_ids;
+        for (i = 0; i < NUM_BUCKETS; i++)
+        {
+            if (counts[i] == 0)
+                continue;
+
+            const char *id_str = bcf_hdr_int2id(header, BCF_DT_ID, ids[i]);
+            if (bcf_update_info_int32(header, rec, id_str, &counts[i], 1) < 0) 
+            {
+                fprintf(stderr, "Error adding %s:-/\n", id_str); 
+                exit(1); 
+            }
+        }
+        hgsc_stats_lap(&stats, HGSC_PHASE_UPDATE);
+    }
 
     return rec;
 }
@@ -199,5 +926,24 @@ bcf1_t *process(bcf1_t *rec)
  *     */
 void destroy(void)
 {
+    hgsc_stats_lap(&stats, HGSC_PHASE_BCFTOOLS);
+    hgsc_decode_destroy(&decode);
+    free(bucket_indices);
+    free(sample_keys);
+    free(table.keys);
+    free(table.counts);
+    free(table.used);
+    free(cells);
+    free(key_counts);
+    free(keys_str.s);
+
+    int i;
+    for (i = 0; i < nsets; i++)
+    {
+        free(sets[i].suffix);
+        free(sets[i].samples);
+    }
+    free(sets);
+    hgsc_stats_report(&stats);
 }
 
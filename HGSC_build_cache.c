@@ -0,0 +1,325 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <htslib/vcf.h>
+#include <htslib/kstring.h>
+#include "bcftools.h"
+#include "HGSC_common.h"
+#include "HGSC_cache.h"
+
+#define OUT_BLOCK 65536  // site data is written out once this many bytes are buffered
+
+int nsamples;
+hgsc_decode_t decode;
+
+bcf_hdr_t *header;
+FILE *out_fp;
+char *out_fname;
+kstring_t out_buf;  // site data not yet written out
+uint64_t out_offset;  // file offset of the end of out_buf
+hgsc_cache_header_t cache_header;
+FILE *sites_fp;  // hgsc_cache_site_t of every site so far, copied after the site data by destroy()
+kstring_t sites;  // those not yet written to sites_fp
+kstring_t gt_escapes;  // hgsc_cache_gt_escape_t of the current site
+kstring_t dp_escapes;  // hgsc_cache_dp_escape_t of the current site
+uint8_t *codes;  // code byte of each sample in the current site, see HGSC_cache.h
+uint8_t *depths;  // DP byte of each sample in the current site
+hgsc_stats_t stats;  // --stats, see HGSC_stats.h
+
+/*
+ *     This short description is used to generate the output of `bcftools plugin -l`.
+ *     */
+const char *about(void)
+{
+    return "Save GT, FT and DP to a genotype cache that the summary plugins can read with --from-cache.\n";
+}
+
+const char *usage(void)
+{
+    return "Usage: bcftools +HGSC_build_cache GENERAL_OPTIONS INPUT.bcf -- --output FILE [--stats] [--stats-json FILE]\n"
+           "About:\n"
+           "\tSaves the contig, position and alleles of each record, and each sample's GT, FT class and DP, to a\n"
+           "\tgenotype cache FILE (see HGSC_cache.h). HGSC_sample_summary, HGSC_variant_summary and HGSC_vcf2csv\n"
+           "\tcan then read FILE with --from-cache instead of decoding INPUT.bcf, and give the same output.\n"
+           "\tMake the cache once for a file that won't change, e.g. a release, and run the summaries from it.\n"
+           "\t--stats prints where the time went to stderr at the end, with a progress line every 10 seconds.\n"
+           "\t--stats-json FILE writes the same summary to FILE as JSON.\n"
+           "bcftools +HGSC_build_cache INPUT.bcf -- --output INPUT.gtc\n"
+           "bcftools view -h INPUT.bcf > header.vcf\n"
+           "bcftools +HGSC_sample_summary header.vcf -- --both --from-cache INPUT.gtc\n";
+}
+
+/*
+ *     Write out whatever is in out_buf.
+ *     */
+void flush_out(void)
+{
+    if (out_buf.l > 0 && fwrite(out_buf.s, 1, out_buf.l, out_fp) != out_buf.l)
+        error("Could not write to %s\n", out_fname);
+    hgsc_stats_output(&stats, out_buf.l);
+    out_buf.l = 0;
+}
+
+/*
+ *     Pad out_buf so the file is a multiple of align bytes long.
+ *     */
+void pad_out(int align)
+{
+    while (out_offset % align != 0)
+    {
+        kputc_(0, &out_buf);
+        out_offset++;
+    }
+}
+
+void put_out(const void *data, size_t len)
+{
+    if (len == 0)  // e.g. a site without escapes, whose buffer may still be NULL
+        return;
+    kputsn_(data, len, &out_buf);
+    out_offset += len;
+}
+
+/*
+ *     Move the buffered site descriptors to sites_fp, so memory doesn't grow with the number of sites.
+ *     */
+void flush_sites(void)
+{
+    if (sites.l > 0 && fwrite(sites.s, 1, sites.l, sites_fp) != sites.l)
+        error("Could not write the sites of %s to a temporary file\n", out_fname);
+    sites.l = 0;
+}
+
+/*
+ *     Called once at startup, allows to initialize local variables.
+ *         Return 1 to suppress VCF/BCF header from printing, 0 otherwise.
+ *         */
+int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
+{
+    hgsc_stats_init(&stats, "HGSC_build_cache", &argc, argv, in);
+    nsamples = bcf_hdr_nsamples(in);
+    header = in;
+    out_fname = NULL;
+    decode.stats = &stats;
+
+    static struct option long_options[] =
+    {
+        {"help", no_argument, NULL, 'h'},
+        {"output", required_argument, NULL, 'o'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "ho:", long_options, NULL)) >= 0)
+    {
+        switch(opt)
+        {
+            case 'o': out_fname = optarg; break;
+            default: error("%s", usage()); break;
+        }
+    }
+    if (optind != argc || out_fname == NULL)
+        error("%s", usage());
+
+    out_fp = fopen(out_fname, "w");
+    if (out_fp == NULL)
+        error("Could not create %s\n", out_fname);
+
+    // next to the output, which has room for the sites anyway; unlinked now so it goes away however we exit
+    kstring_t sites_fname = {0, 0, NULL};
+    ksprintf(&sites_fname, "%s.sites.tmp", out_fname);
+    sites_fp = fopen(sites_fname.s, "w+");
+    if (sites_fp == NULL)
+        error("Could not create %s\n", sites_fname.s);
+    unlink(sites_fname.s);
+    free(sites_fname.s);
+
+    codes = malloc(nsamples + 1);
+    depths = malloc(nsamples + 1);
+    if (codes == NULL || depths == NULL)
+        error("Could not allocate site buffers for %d samples\n", nsamples);
+    memset(&out_buf, 0, sizeof(out_buf));
+    memset(&sites, 0, sizeof(sites));
+    memset(&gt_escapes, 0, sizeof(gt_escapes));
+    memset(&dp_escapes, 0, sizeof(dp_escapes));
+
+    // filled in by destroy()
+    memset(&cache_header, 0, sizeof(cache_header));
+    memcpy(cache_header.magic, HGSC_CACHE_MAGIC, sizeof(cache_header.magic));
+    out_offset = 0;
+    put_out(&cache_header, sizeof(cache_header));
+
+    hgsc_stats_lap(&stats, HGSC_PHASE_SETUP);
+    return 1;
+}
+
+
+// encode_gt_<width>_<ploidy>: add the GT of each sample to its code byte, escaping what the code can't hold
+#define ENCODE_GT(suffix, gt_t, ploidy) \
+static void encode_gt_##suffix(const hgsc_fmt_view_t *gt) \
+{ \
+    int i; \
+    for (i = 0; i < nsamples; i++) \
+    { \
+        int all1 = HGSC_GT_ALLELE_P(gt_t, gt, ploidy, i, 0), all2 = HGSC_GT_ALLELE_P(gt_t, gt, ploidy, i, 1); \
+        int code = hgsc_cache_gt_code(all1, all2); \
+        codes[i] |= code; \
+        if (code == HGSC_CACHE_GT_ESCAPE) \
+        { \
+            hgsc_cache_gt_escape_t escape = {i, all1 < 0 ? -1 : all1, all2 < 0 ? -1 : all2}; \
+            kputsn_(&escape, sizeof(escape), &gt_escapes); \
+        } \
+    } \
+}
+HGSC_FOR_EACH_WIDTH_PLOIDY(ENCODE_GT)
+
+// encode_dp_int8/_int16/_int32: the DP byte of each sample, escaping values above HGSC_CACHE_DP_MAX
+#define ENCODE_DP(width, dp_t) \
+static void encode_dp_##width(const hgsc_fmt_view_t *dp) \
+{ \
+    int i; \
+    for (i = 0; i < nsamples; i++) \
+    { \
+        int depth = HGSC_VIEW_VALUE(dp_t, dp, i, 0); \
+        if (depth < 0) \
+        { \
+            depths[i] = HGSC_CACHE_DP_MISSING; \
+        } \
+        else if (depth <= HGSC_CACHE_DP_MAX) \
+        { \
+            depths[i] = depth; \
+        } \
+        else \
+        { \
+            hgsc_cache_dp_escape_t escape = {i, depth}; \
+            kputsn_(&escape, sizeof(escape), &dp_escapes); \
+            depths[i] = HGSC_CACHE_DP_ESCAPE; \
+        } \
+    } \
+}
+HGSC_FOR_EACH_WIDTH(ENCODE_DP)
+
+
+/*
+ *     Called for each VCF record. Return rec to output the line or NULL
+ *         to suppress output.
+ *         */
+bcf1_t *process(bcf1_t *rec)
+{
+    hgsc_stats_lap(&stats, HGSC_PHASE_BCFTOOLS);
+    hgsc_stats_record(&stats, rec->rid, rec->pos);
+    int decoded = hgsc_decode_fields(&decode, header, rec, nsamples, HGSC_CACHE_FIELDS);
+    gt_escapes.l = 0;
+    dp_escapes.l = 0;
+
+    int i;
+    if (decoded & HGSC_FIELD_FT)
+    {
+        for (i = 0; i < nsamples; i++)
+            codes[i] = decode.ft_codes[i] << 4;
+    }
+    else
+    {
+        memset(codes, HGSC_FT_NFLT << 4, nsamples);
+    }
+    if (decoded & HGSC_FIELD_GT_VIEW)
+        HGSC_GT_DISPATCH(&decode.gt_view, encode_gt, &decode.gt_view);
+    if (decoded & HGSC_FIELD_DP_VIEW)
+        HGSC_VIEW_DISPATCH(&decode.depth_view, encode_dp, &decode.depth_view);
+    hgsc_stats_lap(&stats, HGSC_PHASE_COUNT);
+
+    hgsc_cache_site_t site;
+    memset(&site, 0, sizeof(site));
+    site.offset = out_offset;
+    site.rid = rec->rid;
+    site.pos = rec->pos;
+    site.n_allele = rec->n_allele;
+    site.fields = decoded;
+    site.n_gt_escapes = gt_escapes.l / sizeof(hgsc_cache_gt_escape_t);
+    site.n_dp_escapes = dp_escapes.l / sizeof(hgsc_cache_dp_escape_t);
+    kputsn_(&site, sizeof(site), &sites);
+
+    put_out(codes, nsamples);
+    if (decoded & HGSC_FIELD_DP_VIEW)
+        put_out(depths, nsamples);
+    pad_out(4);
+    put_out(gt_escapes.s, gt_escapes.l);
+    put_out(dp_escapes.s, dp_escapes.l);
+    for (i = 0; i < rec->n_allele; i++)
+        put_out(rec->d.allele[i], strlen(rec->d.allele[i]) + 1);
+    pad_out(4);
+
+    cache_header.nsites++;
+    if (out_buf.l >= OUT_BLOCK)
+        flush_out();
+    if (sites.l >= OUT_BLOCK)
+        flush_sites();
+    hgsc_stats_lap(&stats, HGSC_PHASE_OUTPUT);
+
+    return NULL;
+}
+
+
+/*
+ *     Write the sites, samples and contigs after the site data, then go back and fill in the header.
+ *     */
+void destroy(void)
+{
+    hgsc_stats_lap(&stats, HGSC_PHASE_BCFTOOLS);
+    hgsc_cache_header_t *h = &cache_header;
+    h->nsamples = nsamples;
+
+    pad_out(sizeof(uint64_t));
+    h->sites_offset = out_offset;
+    flush_out();
+
+    // copy the sites over a block at a time
+    flush_sites();
+    if (fflush(sites_fp) != 0 || fseek(sites_fp, 0, SEEK_SET) != 0)
+        error("Could not read back the sites of %s\n", out_fname);
+    if (ks_resize(&out_buf, OUT_BLOCK) < 0)
+        error("Could not allocate %d bytes to copy the sites of %s\n", OUT_BLOCK, out_fname);
+    uint64_t sites_len = h->nsites * sizeof(hgsc_cache_site_t);
+    while (out_offset - h->sites_offset < sites_len)
+    {
+        size_t len = sites_len - (out_offset - h->sites_offset);
+        if (len > OUT_BLOCK)
+            len = OUT_BLOCK;
+        if (fread(out_buf.s, 1, len, sites_fp) != len)
+            error("Could not read back the sites of %s\n", out_fname);
+        out_buf.l = len;
+        out_offset += len;
+        flush_out();
+    }
+    fclose(sites_fp);
+
+    int i;
+    h->samples_offset = out_offset;
+    for (i = 0; i < nsamples; i++)
+        put_out(header->samples[i], strlen(header->samples[i]) + 1);
+
+    h->contigs_offset = out_offset;
+    uint32_t ncontigs = header->n[BCF_DT_CTG];
+    put_out(&ncontigs, sizeof(ncontigs));
+    for (i = 0; i < ncontigs; i++)
+        put_out(bcf_hdr_id2name(header, i), strlen(bcf_hdr_id2name(header, i)) + 1);
+    flush_out();
+
+    h->file_size = out_offset;
+    if (fseek(out_fp, 0, SEEK_SET) != 0 || fwrite(h, sizeof(*h), 1, out_fp) != 1)
+        error("Could not write the header of %s\n", out_fname);
+    if (fclose(out_fp) != 0)
+        error("Could not close %s\n", out_fname);
+    hgsc_stats_lap(&stats, HGSC_PHASE_OUTPUT);
+
+    free(out_buf.s);
+    free(sites.s);
+    free(gt_escapes.s);
+    free(dp_escapes.s);
+    free(codes);
+    free(depths);
+    hgsc_decode_destroy(&decode);
+    hgsc_stats_report(&stats);
+}
@@ -0,0 +1,391 @@
+/*
+ *     Genotype cache files. HGSC_build_cache reads a BCF once and saves what the summary plugins count in each
+ *     record (contig, position, alleles, and each sample's GT, FT class and DP) in a file that is memory-mapped and
+ *     expanded straight back into an hgsc_decode_t. Repeat runs with --from-cache then skip BGZF and BCF decoding.
+ *
+ *     Each site stores one code byte and one DP byte per sample:
+ *
+ *         code: GT in the low 4 bits, 3 * (allele1 + 1) + (allele2 + 1) when both alleles are ., 0 or 1, otherwise
+ *               HGSC_CACHE_GT_ESCAPE with the exact alleles in the site's GT escapes. The HGSC_FT_* class is in
+ *               the next 3 bits.
+ *         DP:   the value itself up to HGSC_CACHE_DP_MAX, HGSC_CACHE_DP_ESCAPE with the exact value in the site's DP
+ *               escapes, or HGSC_CACHE_DP_MISSING for a missing or negative value.
+ *
+ *     A haploid call is stored with the second allele HGSC_GT_ALLELE() gives it, the same as its first, so the
+ *     summaries come out exactly as they would from the BCF. Missing and vector_end alleles are both stored as
+ *     missing; the summaries only ever test those for being negative. Numbers are in native byte
+ *     order and offsets are from the start of the file:
+ *
+ *         site data:      one block per site at its hgsc_cache_site_t offset, a multiple of 4: nsamples code
+ *                         bytes, nsamples DP bytes if the site has DP, padding to a multiple of 4, the GT escapes,
+ *                         the DP escapes, then the n_allele NUL-terminated alleles
+ *         sites_offset:   nsites hgsc_cache_site_t, in input order
+ *         samples_offset: nsamples NUL-terminated sample names
+ *         contigs_offset: uint32 number of contigs, then the NUL-terminated contig names
+ *     */
+#ifndef HGSC_CACHE_H
+#define HGSC_CACHE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <htslib/vcf.h>
+#include "bcftools.h"
+#include "HGSC_common.h"
+
+#define HGSC_CACHE_MAGIC "HGSCgtc\x02"  // format version 2: haploid calls stored as a/a
+#define HGSC_CACHE_FIELDS (HGSC_FIELD_FT | HGSC_FIELD_GT_VIEW | HGSC_FIELD_DP_VIEW)  // what a site can have
+#define HGSC_CACHE_GT_ESCAPE 15
+#define HGSC_CACHE_DP_MAX 253
+#define HGSC_CACHE_DP_ESCAPE 254
+#define HGSC_CACHE_DP_MISSING 255
+
+typedef struct
+{
+    char magic[8];
+    uint64_t nsamples;
+    uint64_t nsites;
+    uint64_t sites_offset;
+    uint64_t samples_offset;
+    uint64_t contigs_offset;
+    uint64_t file_size;  // so a truncated file is caught when it's opened
+} hgsc_cache_header_t;
+
+typedef struct
+{
+    uint64_t offset;  // of the site data
+    int32_t rid;  // index into the contigs of the cache
+    int32_t pos;  // 0-based, as in bcf1_t
+    uint32_t n_allele;
+    uint32_t fields;  // HGSC_CACHE_FIELDS that hgsc_decode_fields() could read from the record
+    uint32_t n_gt_escapes;
+    uint32_t n_dp_escapes;
+} hgsc_cache_site_t;
+
+typedef struct
+{
+    int32_t sample;
+    int32_t all1;  // -1 for any missing allele or vector_end
+    int32_t all2;
+} hgsc_cache_gt_escape_t;
+
+typedef struct
+{
+    int32_t sample;
+    int32_t depth;
+} hgsc_cache_dp_escape_t;
+
+typedef struct
+{
+    const uint8_t *data;  // the whole file, mapped
+    size_t len;
+    const char *fname;
+    int nsamples;
+    uint64_t nsites;
+    const hgsc_cache_site_t *sites;
+    const char **contigs;  // names of the contigs of the cache
+    int *rids;  // the same contigs in the reading header, -1 if it doesn't have them
+    uint32_t ncontigs;
+    const char **alleles;  // see hgsc_cache_alleles()
+    int m_alleles;
+} hgsc_cache_t;
+
+// GT values of each code, as they are packed in a record; escapes read as ./. until they are filled in
+static const int8_t hgsc_cache_gt_values[16][2] =
+{
+    {0, 0}, {0, 2}, {0, 4}, {2, 0}, {2, 2}, {2, 4}, {4, 0}, {4, 2}, {4, 4},
+    {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0},
+};
+
+/*
+ *     GT part of the code byte of a genotype whose alleles are all1 and all2, as HGSC_GT_ALLELE() gives them.
+ *     */
+static inline int hgsc_cache_gt_code(int all1, int all2)
+{
+    if (all1 > 1 || all2 > 1)
+        return HGSC_CACHE_GT_ESCAPE;
+    return 3 * (all1 < 0 ? 0 : all1 + 1) + (all2 < 0 ? 0 : all2 + 1);
+}
+
+/*
+ *     Bytes from the start of a site's data to its alleles.
+ *     */
+static inline size_t hgsc_cache_alleles_offset(const hgsc_cache_site_t *site, int nsamples)
+{
+    size_t bytes = (size_t) nsamples * (site->fields & HGSC_FIELD_DP_VIEW ? 2 : 1);
+    return ((bytes + 3) & ~(size_t) 3) + site->n_gt_escapes * sizeof(hgsc_cache_gt_escape_t)
+           + site->n_dp_escapes * sizeof(hgsc_cache_dp_escape_t);
+}
+
+/*
+ *     Map fname and check that it holds the same samples in the same order as hdr.
+ *     */
+static inline void hgsc_cache_open(hgsc_cache_t *cache, const char *fname, const bcf_hdr_t *hdr)
+{
+    memset(cache, 0, sizeof(*cache));
+    cache->fname = fname;
+
+    int fd = open(fname, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+        error("Could not open %s\n", fname);
+    cache->len = st.st_size;
+    if (cache->len < sizeof(hgsc_cache_header_t))
+        error("%s is not a genotype cache\n", fname);
+    void *data = mmap(NULL, cache->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        error("Could not map %s\n", fname);
+    posix_madvise(data, cache->len, POSIX_MADV_SEQUENTIAL);  // just a hint; sites are read in order
+    cache->data = data;
+
+    const hgsc_cache_header_t *h = data;
+    if (memcmp(h->magic, HGSC_CACHE_MAGIC, sizeof(h->magic) - 1) == 0
+        && memcmp(h->magic, HGSC_CACHE_MAGIC, sizeof(h->magic)) != 0)
+        error("%s is a genotype cache of another format version. Rebuild it with HGSC_build_cache\n", fname);
+    if (memcmp(h->magic, HGSC_CACHE_MAGIC, sizeof(h->magic)) != 0)
+        error("%s is not a genotype cache\n", fname);
+    if (h->file_size != cache->len || h->sites_offset % sizeof(uint64_t) != 0
+        || h->sites_offset < sizeof(*h) || h->sites_offset > h->samples_offset
+        || (h->samples_offset - h->sites_offset) / sizeof(hgsc_cache_site_t) < h->nsites
+        || h->samples_offset > h->contigs_offset || h->contigs_offset + sizeof(uint32_t) > cache->len)
+        error("%s is truncated or corrupt\n", fname);
+    if (h->nsamples != bcf_hdr_nsamples(hdr))
+        error("%s has %d samples but the input has %d\n", fname, (int) h->nsamples, bcf_hdr_nsamples(hdr));
+    cache->nsamples = h->nsamples;
+    cache->nsites = h->nsites;
+    cache->sites = (const hgsc_cache_site_t *) (cache->data + h->sites_offset);
+
+    const char *name = (const char *) cache->data + h->samples_offset;
+    const char *end = (const char *) cache->data + h->contigs_offset;
+    int i;
+    for (i = 0; i < cache->nsamples; i++)
+    {
+        const char *nul = memchr(name, 0, end - name);
+        if (nul == NULL)
+            error("%s is truncated or corrupt\n", fname);
+        if (strcmp(name, hdr->samples[i]) != 0)
+            error("Sample %d of %s does not match sample %s of the input\n", i + 1, fname, hdr->samples[i]);
+        name = nul + 1;
+    }
+
+    memcpy(&cache->ncontigs, cache->data + h->contigs_offset, sizeof(uint32_t));
+    cache->contigs = malloc((cache->ncontigs + 1) * sizeof(char *));
+    cache->rids = malloc((cache->ncontigs + 1) * sizeof(int));
+    if (cache->contigs == NULL || cache->rids == NULL)
+        error("Could not allocate the contigs of %s\n", fname);
+    name = (const char *) cache->data + h->contigs_offset + sizeof(uint32_t);
+    end = (const char *) cache->data + cache->len;
+    for (i = 0; i < cache->ncontigs; i++)
+    {
+        const char *nul = memchr(name, 0, end - name);
+        if (nul == NULL)
+            error("%s is truncated or corrupt\n", fname);
+        cache->contigs[i] = name;
+        cache->rids[i] = bcf_hdr_name2id(hdr, name);
+        name = nul + 1;
+    }
+
+    // the fixed part of every site must fit, so reading one never needs more than a check on its escapes
+    uint64_t j;
+    for (j = 0; j < cache->nsites; j++)
+    {
+        const hgsc_cache_site_t *site = &cache->sites[j];
+        if (site->offset % 4 != 0 || site->offset < sizeof(*h) || site->offset > h->sites_offset
+            || h->sites_offset - site->offset < hgsc_cache_alleles_offset(site, cache->nsamples)
+            || site->rid < 0 || site->rid >= cache->ncontigs)
+            error("%s is truncated or corrupt\n", fname);
+    }
+}
+
+static inline const hgsc_cache_site_t *hgsc_cache_site(const hgsc_cache_t *cache, uint64_t j)
+{
+    return &cache->sites[j];
+}
+
+/*
+ *     Contig of site j in the reading header.
+ *     */
+static inline int hgsc_cache_rid(const hgsc_cache_t *cache, uint64_t j)
+{
+    int rid = cache->rids[cache->sites[j].rid];
+    if (rid < 0)
+        error("Contig %s of %s is not in the input header\n", cache->contigs[cache->sites[j].rid], cache->fname);
+    return rid;
+}
+
+/*
+ *     The n_allele alleles of site j, like rec->d.allele. Valid until the next call.
+ *     */
+static inline const char **hgsc_cache_alleles(hgsc_cache_t *cache, uint64_t j)
+{
+    const hgsc_cache_site_t *site = &cache->sites[j];
+    if (cache->m_alleles < site->n_allele)
+    {
+        cache->m_alleles = site->n_allele;
+        cache->alleles = realloc(cache->alleles, cache->m_alleles * sizeof(char *));
+        if (cache->alleles == NULL)
+            error("Could not allocate allele table.\n");
+    }
+
+    const char *allele = (const char *) cache->data + site->offset + hgsc_cache_alleles_offset(site, cache->nsamples);
+    const char *end = (const char *) cache->sites;
+    int i;
+    for (i = 0; i < site->n_allele; i++)
+    {
+        const char *nul = memchr(allele, 0, end - allele);
+        if (nul == NULL)
+            error("%s is truncated or corrupt\n", cache->fname);
+        cache->alleles[i] = allele;
+        allele = nul + 1;
+    }
+    return cache->alleles;
+}
+
+/*
+ *     Grow *buf to at least len bytes.
+ *     */
+static inline void hgsc_cache_grow(uint8_t **buf, size_t *num_buf, size_t len)
+{
+    if (*num_buf >= len)
+        return;
+    uint8_t *tmp = realloc(*buf, len);
+    if (tmp == NULL)
+        error("Could not allocate %zu bytes to expand a cached site\n", len);
+    *buf = tmp;
+    *num_buf = len;
+}
+
+// hgsc_cache_expand_gt_int8/_int16/_int32: GT values of every sample from the code bytes and the GT escapes
+#define HGSC_CACHE_EXPAND_GT(width, gt_t) \
+static inline void hgsc_cache_expand_gt_##width(gt_t *gt, const uint8_t *codes, int nsamples, \
+                                                const hgsc_cache_gt_escape_t *escapes, int nescapes) \
+{ \
+    int i; \
+    for (i = 0; i < nsamples; i++) \
+    { \
+        gt[2 * i] = hgsc_cache_gt_values[codes[i] & 15][0]; \
+        gt[2 * i + 1] = hgsc_cache_gt_values[codes[i] & 15][1]; \
+    } \
+    for (i = 0; i < nescapes; i++) \
+    { \
+        gt[2 * escapes[i].sample] = escapes[i].all1 < 0 ? bcf_gt_missing : bcf_gt_unphased(escapes[i].all1); \
+        gt[2 * escapes[i].sample + 1] = escapes[i].all2 < 0 ? bcf_gt_missing : bcf_gt_unphased(escapes[i].all2); \
+    } \
+}
+HGSC_FOR_EACH_WIDTH(HGSC_CACHE_EXPAND_GT)
+
+// hgsc_cache_expand_dp_int16/_int32: DP of every sample from the DP bytes and the DP escapes; 253 doesn't fit in int8
+#define HGSC_CACHE_EXPAND_DP(width, dp_t) \
+static inline void hgsc_cache_expand_dp_##width(dp_t *dp, dp_t missing, const uint8_t *depths, int nsamples, \
+                                                const hgsc_cache_dp_escape_t *escapes, int nescapes) \
+{ \
+    int i; \
+    for (i = 0; i < nsamples; i++) \
+        dp[i] = depths[i] == HGSC_CACHE_DP_MISSING ? missing : depths[i]; \
+    for (i = 0; i < nescapes; i++) \
+        dp[escapes[i].sample] = escapes[i].depth; \
+}
+HGSC_CACHE_EXPAND_DP(int16, int16_t)
+HGSC_CACHE_EXPAND_DP(int32, int32_t)
+
+/*
+ *     Expand the `fields` of site j (HGSC_CACHE_FIELDS flags) into ctx the way hgsc_decode_fields() with
+ *     HGSC_FIELD_KEEP reads them from the record: FT into ft_codes, GT and DP as views of copies owned by ctx, so
+ *     they stay valid after the cache is closed. GT and DP come out at the narrowest width that holds the site.
+ *     Returns the flags of the fields the record had.
+ *     */
+static inline int hgsc_cache_decode(hgsc_cache_t *cache, uint64_t j, hgsc_decode_t *ctx, int fields)
+{
+    const hgsc_cache_site_t *site = &cache->sites[j];
+    int nsamples = cache->nsamples;
+    int decoded = site->fields & fields & HGSC_CACHE_FIELDS;
+    const uint8_t *codes = cache->data + site->offset;
+    const uint8_t *depths = codes + nsamples;
+    size_t escapes_offset = ((size_t) nsamples * (site->fields & HGSC_FIELD_DP_VIEW ? 2 : 1) + 3) & ~(size_t) 3;
+    const hgsc_cache_gt_escape_t *gt_escapes = (const hgsc_cache_gt_escape_t *) (codes + escapes_offset);
+    const hgsc_cache_dp_escape_t *dp_escapes = (const hgsc_cache_dp_escape_t *) (gt_escapes + site->n_gt_escapes);
+    int i;
+
+    // FT is filled in even if the record had none to read, the same as for "." in every sample
+    if (fields & HGSC_FIELD_FT)
+    {
+        if (ctx->num_ft_codes < nsamples)
+        {
+            uint8_t *tmp = realloc(ctx->ft_codes, nsamples);
+            if (tmp == NULL)
+                error("Could not allocate FT codes for %d samples\n", nsamples);
+            ctx->ft_codes = tmp;
+            ctx->num_ft_codes = nsamples;
+        }
+        for (i = 0; i < nsamples; i++)
+            ctx->ft_codes[i] = (codes[i] >> 4) & 7;
+        hgsc_stats_lap(ctx->stats, HGSC_PHASE_FT);
+    }
+
+    if (decoded & HGSC_FIELD_GT_VIEW)
+    {
+        int max_allele = 0;
+        for (i = 0; i < site->n_gt_escapes; i++)
+        {
+            if (gt_escapes[i].sample < 0 || gt_escapes[i].sample >= nsamples)
+                error("%s is truncated or corrupt\n", cache->fname);
+            if (gt_escapes[i].all1 > max_allele)
+                max_allele = gt_escapes[i].all1;
+            if (gt_escapes[i].all2 > max_allele)
+                max_allele = gt_escapes[i].all2;
+        }
+
+        hgsc_fmt_view_t *gt = &ctx->gt_view;
+        gt->type = max_allele < INT8_MAX / 2 ? BCF_BT_INT8 : max_allele < INT16_MAX / 2 ? BCF_BT_INT16 : BCF_BT_INT32;
+        gt->n = 2;
+        gt->size = 2 * (gt->type == BCF_BT_INT8 ? 1 : gt->type == BCF_BT_INT16 ? 2 : 4);
+        hgsc_cache_grow(&ctx->gt_packed, &ctx->num_gt_packed, (size_t) gt->size * nsamples + 1);
+        gt->p = ctx->gt_packed;
+        HGSC_VIEW_DISPATCH(gt, hgsc_cache_expand_gt, (void *) ctx->gt_packed, codes, nsamples, gt_escapes,
+                           site->n_gt_escapes);
+        hgsc_stats_lap(ctx->stats, HGSC_PHASE_GT);
+    }
+
+    if (decoded & HGSC_FIELD_DP_VIEW)
+    {
+        int max_depth = 0;
+        for (i = 0; i < site->n_dp_escapes; i++)
+        {
+            if (dp_escapes[i].sample < 0 || dp_escapes[i].sample >= nsamples)
+                error("%s is truncated or corrupt\n", cache->fname);
+            if (dp_escapes[i].depth > max_depth)
+                max_depth = dp_escapes[i].depth;
+        }
+
+        hgsc_fmt_view_t *dp = &ctx->depth_view;
+        dp->type = max_depth <= INT16_MAX ? BCF_BT_INT16 : BCF_BT_INT32;
+        dp->n = 1;
+        dp->size = dp->type == BCF_BT_INT16 ? 2 : 4;
+        hgsc_cache_grow(&ctx->depth_packed, &ctx->num_depth_packed, (size_t) dp->size * nsamples + 1);
+        dp->p = ctx->depth_packed;
+        if (dp->type == BCF_BT_INT16)
+            hgsc_cache_expand_dp_int16((int16_t *) ctx->depth_packed, bcf_int16_missing, depths, nsamples,
+                                       dp_escapes, site->n_dp_escapes);
+        else
+            hgsc_cache_expand_dp_int32((int32_t *) ctx->depth_packed, bcf_int32_missing, depths, nsamples,
+                                       dp_escapes, site->n_dp_escapes);
+        hgsc_stats_lap(ctx->stats, HGSC_PHASE_DP);
+    }
+
+    return decoded;
+}
+
+static inline void hgsc_cache_close(hgsc_cache_t *cache)
+{
+    munmap((void *) cache->data, cache->len);
+    free(cache->contigs);
+    free(cache->rids);
+    free(cache->alleles);
+    memset(cache, 0, sizeof(*cache));
+}
+
+#endif
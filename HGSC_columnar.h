@@ -0,0 +1,174 @@
+/*
+ *     Columnar output for the summary plugins' tables, so they can be loaded as typed columns instead of parsing CSV.
+ *     Rows are gathered into per-column buffers and written a row group at a time. Like a partial (see HGSC_partial.h)
+ *     the file is a BGZF stream, so any gzip reader can decompress it:
+ *
+ *         magic            "HGSCcol\x01"
+ *         int32            number of columns
+ *         for each column  int32 type (HGSC_COL_*), then its NUL-terminated name
+ *         row groups       int32 number of rows, then each column's values for those rows in column order: the
+ *                          int32/int64/float64 values back to back, or for a string column an int64 byte count
+ *                          followed by that many bytes of NUL-terminated strings
+ *         end              a row group of 0 rows
+ *
+ *     Numbers are stored in native byte order, like partials.
+ *     */
+#ifndef HGSC_COLUMNAR_H
+#define HGSC_COLUMNAR_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <htslib/bgzf.h>
+#include <htslib/kstring.h>
+#include "bcftools.h"
+
+#define HGSC_COLUMNAR_MAGIC "HGSCcol\x01"
+#define HGSC_COLUMNAR_GROUP_ROWS 65536  // rows per row group
+
+// Column types
+#define HGSC_COL_INT32 1
+#define HGSC_COL_INT64 2
+#define HGSC_COL_FLOAT64 3
+#define HGSC_COL_STRING 4
+
+typedef struct
+{
+    BGZF *fp;
+    const char *fname;
+    int ncols;
+    int *types;
+    kstring_t *values;  // each column's values for the current row group
+    int nrows;  // rows in the current row group
+    int col;  // next column of the row being added
+} hgsc_columnar_t;
+
+static inline void hgsc_columnar_write(hgsc_columnar_t *cols, const void *data, size_t len)
+{
+    if (bgzf_write(cols->fp, data, len) != (ssize_t) len)
+        error("Could not write to %s\n", cols->fname);
+}
+
+/*
+ *     Create fname and write the ncols column names and HGSC_COL_* types.
+ *     */
+static inline void hgsc_columnar_create(hgsc_columnar_t *cols, const char *fname, int ncols, const char **names,
+                                        const int *types)
+{
+    cols->fname = fname;
+    cols->fp = bgzf_open(fname, "w");
+    if (cols->fp == NULL)
+        error("Could not create %s\n", fname);
+
+    cols->ncols = ncols;
+    cols->types = malloc(ncols * sizeof(int));
+    cols->values = calloc(ncols, sizeof(kstring_t));
+    if (cols->types == NULL || cols->values == NULL)
+        error("Could not allocate %d columns\n", ncols);
+    memcpy(cols->types, types, ncols * sizeof(int));
+    cols->nrows = 0;
+    cols->col = 0;
+
+    hgsc_columnar_write(cols, HGSC_COLUMNAR_MAGIC, 8);
+    int32_t n = ncols;
+    hgsc_columnar_write(cols, &n, sizeof(n));
+
+    int i;
+    for (i = 0; i < ncols; i++)
+    {
+        int32_t type = types[i];
+        hgsc_columnar_write(cols, &type, sizeof(type));
+        hgsc_columnar_write(cols, names[i], strlen(names[i]) + 1);
+    }
+}
+
+/*
+ *     Append len bytes to the next column of the current row, which must be of the given type.
+ *     */
+static inline void hgsc_columnar_put(hgsc_columnar_t *cols, int type, const void *data, size_t len)
+{
+    if (cols->col >= cols->ncols || cols->types[cols->col] != type)
+        error("Column %d of %s is not of type %d\n", cols->col + 1, cols->fname, type);
+    if (kputsn_(data, len, &cols->values[cols->col]) < 0)
+        error("Could not allocate column %d of %s\n", cols->col + 1, cols->fname);
+    cols->col++;
+}
+
+static inline void hgsc_columnar_put_int32(hgsc_columnar_t *cols, int32_t value)
+{
+    hgsc_columnar_put(cols, HGSC_COL_INT32, &value, sizeof(value));
+}
+
+static inline void hgsc_columnar_put_int64(hgsc_columnar_t *cols, int64_t value)
+{
+    hgsc_columnar_put(cols, HGSC_COL_INT64, &value, sizeof(value));
+}
+
+static inline void hgsc_columnar_put_float64(hgsc_columnar_t *cols, double value)
+{
+    hgsc_columnar_put(cols, HGSC_COL_FLOAT64, &value, sizeof(value));
+}
+
+static inline void hgsc_columnar_put_string(hgsc_columnar_t *cols, const char *value)
+{
+    hgsc_columnar_put(cols, HGSC_COL_STRING, value, strlen(value) + 1);
+}
+
+/*
+ *     Write out the current row group, if it has any rows.
+ *     */
+static inline void hgsc_columnar_flush(hgsc_columnar_t *cols)
+{
+    if (cols->nrows == 0)
+        return;
+
+    int32_t nrows = cols->nrows;
+    hgsc_columnar_write(cols, &nrows, sizeof(nrows));
+
+    int i;
+    for (i = 0; i < cols->ncols; i++)
+    {
+        kstring_t *values = &cols->values[i];
+        if (cols->types[i] == HGSC_COL_STRING)
+        {
+            int64_t len = values->l;
+            hgsc_columnar_write(cols, &len, sizeof(len));
+        }
+        hgsc_columnar_write(cols, values->s, values->l);
+        values->l = 0;
+    }
+    cols->nrows = 0;
+}
+
+/*
+ *     Finish the row whose columns were just put, writing out the row group when it is full.
+ *     */
+static inline void hgsc_columnar_end_row(hgsc_columnar_t *cols)
+{
+    if (cols->col != cols->ncols)
+        error("Row of %s has %d columns instead of %d\n", cols->fname, cols->col, cols->ncols);
+    cols->col = 0;
+    if (++cols->nrows == HGSC_COLUMNAR_GROUP_ROWS)
+        hgsc_columnar_flush(cols);
+}
+
+/*
+ *     Write out the last row group and the end marker and close the file.
+ *     */
+static inline void hgsc_columnar_close(hgsc_columnar_t *cols)
+{
+    hgsc_columnar_flush(cols);
+    int32_t end = 0;
+    hgsc_columnar_write(cols, &end, sizeof(end));
+    if (bgzf_close(cols->fp) != 0)
+        error("Could not close %s\n", cols->fname);
+    cols->fp = NULL;
+
+    int i;
+    for (i = 0; i < cols->ncols; i++)
+        free(cols->values[i].s);
+    free(cols->values);
+    free(cols->types);
+}
+
+#endif
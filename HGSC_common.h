@@ -0,0 +1,527 @@
+/*
+ *     Helpers shared by the HGSC plugins. Copy this header into the bcftools plugins folder along with the .c files.
+ *     */
+#ifndef HGSC_COMMON_H
+#define HGSC_COMMON_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <htslib/vcf.h>
+#include <htslib/kstring.h>
+#include "HGSC_stats.h"
+
+// FT classes. The order matches the FILTER part of the HGSC_append_gtcounts tag names.
+#define HGSC_FT_PASS 0  // "PASS"
+#define HGSC_FT_FAIL 1  // any other value
+#define HGSC_FT_NVAR 2  // "No_var"
+#define HGSC_FT_NDAT 3  // "No_data"
+#define HGSC_FT_NFLT 4  // "."
+#define HGSC_FT_NUM 5
+#define HGSC_FT_BIT(code) (1u << (code))
+#define HGSC_FT_PASSING (HGSC_FT_BIT(HGSC_FT_PASS) | HGSC_FT_BIT(HGSC_FT_NVAR))  // what the summaries count as passing
+
+// FORMAT fields, for hgsc_decode_fields()
+#define HGSC_FIELD_FT 1
+#define HGSC_FIELD_GT 2
+#define HGSC_FIELD_DP 4
+#define HGSC_FIELD_GT_VIEW 8  // GT as an hgsc_fmt_view_t instead of widened into gt_data
+#define HGSC_FIELD_DP_VIEW 16  // likewise DP
+#define HGSC_FIELD_KEEP 32  // copy the viewed fields so the views outlive the record, e.g. to count them on another thread
+
+#define HGSC_FT_CACHE_SIZE 64  // power of two; our files only ever carry a handful of distinct FT values
+
+/*
+ *     Remembers the class of every distinct FT value seen so far. Values are keyed on their first 8 bytes: none of
+ *     the special values is longer than 7 characters, so anything that fills all 8 bytes is a FAIL no matter what
+ *     follows and the key is never ambiguous.
+ *     */
+typedef struct
+{
+    uint64_t keys[HGSC_FT_CACHE_SIZE];
+    uint8_t codes[HGSC_FT_CACHE_SIZE];
+    uint8_t used[HGSC_FT_CACHE_SIZE];
+    int n;
+} hgsc_ft_cache_t;
+
+static inline uint8_t hgsc_ft_classify_str(const char *str)
+{
+    if (strcmp(str, "PASS") == 0)
+        return HGSC_FT_PASS;
+    if (strcmp(str, "No_var") == 0)
+        return HGSC_FT_NVAR;
+    if (strcmp(str, "No_data") == 0)
+        return HGSC_FT_NDAT;
+    if (strcmp(str, ".") == 0)
+        return HGSC_FT_NFLT;
+    return HGSC_FT_FAIL;
+}
+
+/*
+ *     Class of the FT value in the first `width` bytes of str (which need not be NUL-terminated).
+ *     */
+static inline uint8_t hgsc_ft_classify(hgsc_ft_cache_t *cache, const char *str, int width)
+{
+    uint64_t key = 0;
+    int i;
+    for (i = 0; i < width && i < 8 && str[i]; i++)
+        key |= (uint64_t) (uint8_t) str[i] << (8 * i);
+
+    uint32_t slot = (uint32_t) ((key * 0x9E3779B97F4A7C15ULL) >> 32) & (HGSC_FT_CACHE_SIZE - 1);
+    while (cache->used[slot])
+    {
+        if (cache->keys[slot] == key)
+            return cache->codes[slot];
+        slot = (slot + 1) & (HGSC_FT_CACHE_SIZE - 1);
+    }
+
+    char buf[9];
+    for (i = 0; i < 8; i++)
+        buf[i] = (char) (key >> (8 * i));
+    buf[8] = 0;
+    uint8_t code = (key >> 56) ? HGSC_FT_FAIL : hgsc_ft_classify_str(buf);
+
+    if (cache->n < HGSC_FT_CACHE_SIZE / 2)  // keep probes short; anything past this is classified uncached
+    {
+        cache->used[slot] = 1;
+        cache->keys[slot] = key;
+        cache->codes[slot] = code;
+        cache->n++;
+    }
+    return code;
+}
+
+/*
+ *     Zero-copy view of one integer FORMAT field: the per-sample values exactly as they are packed in the record, at
+ *     their on-disk width, rather than widened into an int32 copy the way bcf_get_format_int32() does. Sample i's
+ *     values are the n elements starting at p + i * size. Missing and vector_end are the int8/int16/int32 sentinels of
+ *     that width, which are negative just like their int32 counterparts, and a missing GT allele is 0 at every width.
+ *     */
+typedef struct
+{
+    const uint8_t *p;
+    int type;  // BCF_BT_INT8, BCF_BT_INT16 or BCF_BT_INT32
+    int n;  // values per sample
+    int size;  // bytes per sample
+} hgsc_fmt_view_t;
+
+/*
+ *     Point view at the packed values of tag in rec. Valid until rec is changed or the next record is read. Returns the
+ *     number of values per sample, -1 if the record doesn't have the field and -2 if it isn't stored as integers.
+ *     */
+static inline int hgsc_view_fmt(hgsc_fmt_view_t *view, const bcf_hdr_t *hdr, bcf1_t *rec, const char *tag)
+{
+    bcf_fmt_t *fmt = bcf_get_fmt(hdr, rec, tag);
+    if (fmt == NULL || fmt->p == NULL || fmt->n <= 0)
+        return -1;
+    if (fmt->type != BCF_BT_INT8 && fmt->type != BCF_BT_INT16 && fmt->type != BCF_BT_INT32)
+        return -2;
+
+    view->p = fmt->p;
+    view->type = fmt->type;
+    view->n = fmt->n;
+    view->size = fmt->size;
+    return fmt->n;
+}
+
+/*
+ *     Copy the packed values of view into *buf (grown as needed) and point view at the copy, so it stays valid after
+ *     the record is gone. This is still a plain memcpy at the packed width. Returns 0, or -1 if *buf couldn't grow.
+ *     */
+static inline int hgsc_view_keep(hgsc_fmt_view_t *view, uint8_t **buf, size_t *num_buf, int nsamples)
+{
+    size_t len = (size_t) view->size * nsamples;
+    if (*num_buf < len)
+    {
+        uint8_t *tmp = realloc(*buf, len);
+        if (tmp == NULL)
+            return -1;
+        *buf = tmp;
+        *num_buf = len;
+    }
+    memcpy(*buf, view->p, len);
+    view->p = *buf;
+    return 0;
+}
+
+// Instantiate KERNEL(suffix, type) once for each width a packed integer field can have.
+#define HGSC_FOR_EACH_WIDTH(KERNEL) \
+    KERNEL(int8, int8_t) \
+    KERNEL(int16, int16_t) \
+    KERNEL(int32, int32_t)
+
+// Call the name##_int8, name##_int16 or name##_int32 instance that matches the width of view.
+#define HGSC_VIEW_DISPATCH(view, name, ...) \
+    do \
+    { \
+        switch ((view)->type) \
+        { \
+            case BCF_BT_INT8: name##_int8(__VA_ARGS__); break; \
+            case BCF_BT_INT16: name##_int16(__VA_ARGS__); break; \
+            default: name##_int32(__VA_ARGS__); break; \
+        } \
+    } while (0)
+
+// Value j of sample i in a view whose elements are val_t.
+#define HGSC_VIEW_VALUE(val_t, view, i, j) (((const val_t *) (view)->p)[(size_t) (i) * (view)->n + (j)])
+
+// Instantiate a GT KERNEL(suffix, type, ploidy) for each width and for haploid records, diploid records, and records
+// with any other number of values per sample (HGSC_PLOIDY_ANY). With the ploidy a constant, the kernel steps through
+// the samples by a fixed stride and a haploid kernel never looks for a second value, so a haploid record (chrY, chrM,
+// a male-only chrX) reads half the bytes of a diploid one.
+#define HGSC_PLOIDY_ANY 0
+#define HGSC_FOR_EACH_WIDTH_PLOIDY(KERNEL) \
+    KERNEL(int8_1, int8_t, 1) \
+    KERNEL(int8_2, int8_t, 2) \
+    KERNEL(int8_n, int8_t, HGSC_PLOIDY_ANY) \
+    KERNEL(int16_1, int16_t, 1) \
+    KERNEL(int16_2, int16_t, 2) \
+    KERNEL(int16_n, int16_t, HGSC_PLOIDY_ANY) \
+    KERNEL(int32_1, int32_t, 1) \
+    KERNEL(int32_2, int32_t, 2) \
+    KERNEL(int32_n, int32_t, HGSC_PLOIDY_ANY)
+
+// Call the name##_<width>_1, _2 or _n instance that matches the width and the values per sample of a GT view.
+#define HGSC_PLOIDY_SWITCH(n, name, ...) \
+    do \
+    { \
+        if ((n) == 1) \
+            name##_1(__VA_ARGS__); \
+        else if ((n) == 2) \
+            name##_2(__VA_ARGS__); \
+        else \
+            name##_n(__VA_ARGS__); \
+    } while (0)
+#define HGSC_GT_DISPATCH(view, name, ...) \
+    do \
+    { \
+        switch ((view)->type) \
+        { \
+            case BCF_BT_INT8: HGSC_PLOIDY_SWITCH((view)->n, name##_int8, __VA_ARGS__); break; \
+            case BCF_BT_INT16: HGSC_PLOIDY_SWITCH((view)->n, name##_int16, __VA_ARGS__); break; \
+            default: HGSC_PLOIDY_SWITCH((view)->n, name##_int32, __VA_ARGS__); break; \
+        } \
+    } while (0)
+
+// Values per sample in a kernel instantiated for ploidy: the constant itself, or the view's for HGSC_PLOIDY_ANY.
+#define HGSC_PLOIDY_OF(ploidy, view) ((ploidy) != HGSC_PLOIDY_ANY ? (ploidy) : (view)->n)
+
+// The vector_end sentinel at the width of val_t.
+#define HGSC_VECTOR_END(val_t) \
+    ((val_t) (sizeof(val_t) == 1 ? bcf_int8_vector_end \
+              : sizeof(val_t) == 2 ? bcf_int16_vector_end : bcf_int32_vector_end))
+
+// GT value j of sample i in a kernel instantiated for ploidy.
+#define HGSC_GT_VALUE_P(val_t, view, ploidy, i, j) \
+    (((const val_t *) (view)->p)[(size_t) (i) * HGSC_PLOIDY_OF(ploidy, view) + (j)])
+
+// Allele j (0 or 1) of sample i, as bcf_gt_allele() would give for the widened value, in a kernel instantiated for
+// ploidy. A haploid call, in a haploid record or padded with vector_end in a diploid one, reads as if both alleles
+// were the one it has, as hgsc_fill_ft() reads it too: a hemizygous ALT is a hom-alt. A sample without any value is
+// missing.
+#define HGSC_GT_ALLELE_P(val_t, view, ploidy, i, j) \
+    ((j) < HGSC_PLOIDY_OF(ploidy, view) && HGSC_GT_VALUE_P(val_t, view, ploidy, i, j) != HGSC_VECTOR_END(val_t) \
+     ? bcf_gt_allele(HGSC_GT_VALUE_P(val_t, view, ploidy, i, j)) \
+     : (j) > 0 && HGSC_PLOIDY_OF(ploidy, view) > 0 \
+     ? bcf_gt_allele(HGSC_GT_VALUE_P(val_t, view, ploidy, i, 0)) \
+     : -1)
+
+// The same for a view of any ploidy.
+#define HGSC_GT_ALLELE(val_t, view, i, j) HGSC_GT_ALLELE_P(val_t, view, HGSC_PLOIDY_ANY, i, j)
+
+/*
+ *     FORMAT buffers kept alive between process() calls. The bcf_get_* functions only grow a buffer when a record
+ *     needs more room than it already has, so once the first few records are decoded there is no more allocation.
+ *     */
+typedef struct
+{
+    char **filter_data;  // FT, one string per sample
+    int num_filter_data;
+    int32_t *gt_data;  // GT, gt_ploidy values per sample
+    int num_gt_data;
+    int gt_ploidy;  // values per sample in gt_data, 0 if the last hgsc_decode_gt() found no GT
+    int32_t *depth_data;  // DP, one value per sample
+    int num_depth_data;
+    int has_depth;  // 0 if the last hgsc_decode_dp() found no DP, so depth_data is left over from an earlier record
+    const char **new_filter_data;  // scratch space for plugins that rewrite FT, see hgsc_decode_new_ft()
+    int num_new_filter_data;
+    uint8_t *ft_codes;  // HGSC_FT_* class of each sample's FT, see hgsc_decode_ft_codes()
+    int num_ft_codes;
+    hgsc_fmt_view_t gt_view;  // GT and DP at their packed width, see HGSC_FIELD_GT_VIEW and HGSC_FIELD_DP_VIEW
+    hgsc_fmt_view_t depth_view;
+    uint8_t *gt_packed;  // HGSC_FIELD_KEEP copies of the viewed fields
+    size_t num_gt_packed;
+    uint8_t *depth_packed;
+    size_t num_depth_packed;
+    hgsc_ft_cache_t ft_cache;
+    hgsc_stats_t *stats;  // --stats: decoding is timed into the FT, GT and DP phases; may be NULL
+} hgsc_decode_t;
+
+static inline int hgsc_decode_ft(hgsc_decode_t *ctx, const bcf_hdr_t *hdr, bcf1_t *rec)
+{
+    return bcf_get_format_string(hdr, rec, "FT", &ctx->filter_data, &ctx->num_filter_data);
+}
+
+/*
+ *     Decode FT and classify every sample into decode->ft_codes. Returns the bcf_get_format_string() result.
+ *     A record without FT (or a header without it) reads as "." for every sample.
+ *     */
+static inline int hgsc_decode_ft_codes(hgsc_decode_t *ctx, const bcf_hdr_t *hdr, bcf1_t *rec, int nsamples)
+{
+    int ret = hgsc_decode_ft(ctx, hdr, rec);
+    if (ret <= 0 && ret != -1 && ret != -3)
+    {
+        hgsc_stats_lap(ctx->stats, HGSC_PHASE_FT);
+        return ret;
+    }
+
+    if (ctx->num_ft_codes < nsamples)
+    {
+        uint8_t *tmp = realloc(ctx->ft_codes, nsamples);
+        if (tmp == NULL)
+            return -4;
+        ctx->ft_codes = tmp;
+        ctx->num_ft_codes = nsamples;
+    }
+
+    if (ret <= 0)
+    {
+        memset(ctx->ft_codes, HGSC_FT_NFLT, nsamples);
+        hgsc_stats_lap(ctx->stats, HGSC_PHASE_FT);
+        return ret;
+    }
+
+    int width = ret / nsamples - 1;  // strings are NUL-padded to the widest value in the record
+    int i;
+    for (i = 0; i < nsamples; i++)
+        ctx->ft_codes[i] = hgsc_ft_classify(&ctx->ft_cache, ctx->filter_data[i], width);
+
+    hgsc_stats_lap(ctx->stats, HGSC_PHASE_FT);
+    return ret;
+}
+
+static inline int hgsc_decode_gt(hgsc_decode_t *ctx, const bcf_hdr_t *hdr, bcf1_t *rec)
+{
+    int ret = bcf_get_genotypes(hdr, rec, &ctx->gt_data, &ctx->num_gt_data);
+    ctx->gt_ploidy = ret > 0 && bcf_hdr_nsamples(hdr) > 0 ? ret / bcf_hdr_nsamples(hdr) : 0;
+    hgsc_stats_lap(ctx->stats, HGSC_PHASE_GT);
+    return ret;
+}
+
+static inline int hgsc_decode_dp(hgsc_decode_t *ctx, const bcf_hdr_t *hdr, bcf1_t *rec)
+{
+    int ret = bcf_get_format_int32(hdr, rec, "DP", &ctx->depth_data, &ctx->num_depth_data);
+    ctx->has_depth = ret > 0;
+    hgsc_stats_lap(ctx->stats, HGSC_PHASE_DP);
+    return ret;
+}
+
+/*
+ *     Decode only the FORMAT fields in `fields` (HGSC_FIELD_* flags), FT into ft_codes. htslib unpacks every FORMAT
+ *     field of the record either way (BCF_UN_FMT); the saving is that the fields a plugin doesn't ask for are never
+ *     converted or copied out. The _VIEW flags set gt_view and depth_view instead of decoding, see hgsc_fmt_view_t.
+ *     Returns the flags of the fields that could be decoded; FT counts as decoded when the record has none, see
+ *     hgsc_decode_ft_codes().
+ *     */
+static inline int hgsc_decode_fields(hgsc_decode_t *ctx, const bcf_hdr_t *hdr, bcf1_t *rec, int nsamples, int fields)
+{
+    int ret, decoded = 0;
+    if (fields & HGSC_FIELD_FT)
+    {
+        ret = hgsc_decode_ft_codes(ctx, hdr, rec, nsamples);
+        if (ret > 0 || ret == -1 || ret == -3)
+            decoded |= HGSC_FIELD_FT;
+    }
+    if ((fields & HGSC_FIELD_GT) && hgsc_decode_gt(ctx, hdr, rec) > 0)
+        decoded |= HGSC_FIELD_GT;
+    if ((fields & HGSC_FIELD_DP) && hgsc_decode_dp(ctx, hdr, rec) > 0)
+        decoded |= HGSC_FIELD_DP;
+    if (fields & HGSC_FIELD_GT_VIEW)
+    {
+        if (hgsc_view_fmt(&ctx->gt_view, hdr, rec, "GT") > 0
+            && (!(fields & HGSC_FIELD_KEEP) || hgsc_view_keep(&ctx->gt_view, &ctx->gt_packed, &ctx->num_gt_packed, nsamples) == 0))
+            decoded |= HGSC_FIELD_GT_VIEW;
+        hgsc_stats_lap(ctx->stats, HGSC_PHASE_GT);
+    }
+    if (fields & HGSC_FIELD_DP_VIEW)
+    {
+        if (hgsc_view_fmt(&ctx->depth_view, hdr, rec, "DP") > 0
+            && (!(fields & HGSC_FIELD_KEEP) || hgsc_view_keep(&ctx->depth_view, &ctx->depth_packed, &ctx->num_depth_packed, nsamples) == 0))
+            decoded |= HGSC_FIELD_DP_VIEW;
+        hgsc_stats_lap(ctx->stats, HGSC_PHASE_DP);
+    }
+    return decoded;
+}
+
+/*
+ *     Whether any sample's FT class is in `classes` (HGSC_FT_BIT() flags). Lets a plugin skip decoding GT or DP for
+ *     records where no sample would use them.
+ *     */
+static inline int hgsc_any_ft(const hgsc_decode_t *ctx, int nsamples, unsigned int classes)
+{
+    int i;
+    for (i = 0; i < nsamples; i++)
+    {
+        if (HGSC_FT_BIT(ctx->ft_codes[i]) & classes)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ *     Return an array of nsamples string pointers to fill in, or NULL if it could not be allocated.
+ *     */
+static inline const char **hgsc_decode_new_ft(hgsc_decode_t *ctx, int nsamples)
+{
+    if (ctx->num_new_filter_data < nsamples)
+    {
+        const char **tmp = realloc(ctx->new_filter_data, nsamples * sizeof(char *));
+        if (tmp == NULL)
+            return NULL;
+        ctx->new_filter_data = tmp;
+        ctx->num_new_filter_data = nsamples;
+    }
+    return ctx->new_filter_data;
+}
+
+/*
+ *     The HGSC_filt_w_dotdots rule. Every sample whose FT is "." gets a new one from its GT and DP:
+ *     "PASS" if it has a variant allele, "." for ./0, "No_var" for 0/0 with DP >= min_depth, and "No_data" for ./. or for
+ *     0/0 with DP < min_depth, which also becomes ./. . A record without DP (see has_depth) reads as DP < min_depth for
+ *     every sample. Other samples keep their FT. A haploid call, in a haploid record or padded with vector_end in a
+ *     diploid one, is read as if both alleles were the one it has, the same as HGSC_GT_ALLELE_P(), so 0 is a 0/0.
+ *
+ *     hgsc_fill_ft_1/_2/_n are the instances for haploid, diploid and other GT, see HGSC_FOR_EACH_WIDTH_PLOIDY. p is
+ *     the values per sample, only read by _n.
+ *     */
+#define HGSC_FILL_FT(suffix, ploidy) \
+static inline int hgsc_fill_ft_##suffix(hgsc_decode_t *ctx, const char **new_filter_data, int nsamples, int min_depth, \
+                                        int p) \
+{ \
+    const int n = ploidy != HGSC_PLOIDY_ANY ? ploidy : p; \
+    const int32_t *depth_data = ctx->depth_data; \
+    uint8_t *ft_codes = ctx->ft_codes; \
+    int nchanged = 0; \
+    int i, j; \
+    for (i = 0; i < nsamples; i++) \
+    { \
+        if (ft_codes[i] != HGSC_FT_NFLT) \
+        { \
+            new_filter_data[i] = ctx->filter_data[i]; \
+            continue; \
+        } \
+\
+        int32_t *gt = ctx->gt_data + (size_t) i * n; \
+        int all1 = n > 0 ? bcf_gt_allele(gt[0]) : -1; \
+        int all2 = n > 1 && gt[1] != bcf_int32_vector_end ? bcf_gt_allele(gt[1]) : all1; \
+\
+        if (all1 == 0 && all2 == 0) \
+        { \
+            if (!ctx->has_depth || depth_data[i] < min_depth) \
+            { \
+                for (j = 0; j < n; j++) \
+                { \
+                    if (gt[j] != bcf_int32_vector_end) \
+                        gt[j] = bcf_gt_missing; \
+                } \
+                new_filter_data[i] = "No_data"; \
+                ft_codes[i] = HGSC_FT_NDAT; \
+            } \
+            else \
+            { \
+                new_filter_data[i] = "No_var"; \
+                ft_codes[i] = HGSC_FT_NVAR; \
+            } \
+        } \
+        else if (all1 < 0 && all2 >= 0) \
+        { \
+            new_filter_data[i] = "."; \
+        } \
+        else if (all1 < 0 && all2 < 0) \
+        { \
+            new_filter_data[i] = "No_data"; \
+            ft_codes[i] = HGSC_FT_NDAT; \
+        } \
+        else \
+        { \
+            new_filter_data[i] = "PASS"; \
+            ft_codes[i] = HGSC_FT_PASS; \
+        } \
+\
+        if (ft_codes[i] != HGSC_FT_NFLT) \
+            nchanged++; \
+    } \
+    return nchanged; \
+}
+HGSC_FILL_FT(1, 1)
+HGSC_FILL_FT(2, 2)
+HGSC_FILL_FT(n, HGSC_PLOIDY_ANY)
+
+/*
+ *     Apply the rule above. GT, DP and FT codes must already be decoded. gt_data and ft_codes are updated in place and
+ *     new_filter_data[i] points at each sample's FT afterwards. Returns the number of samples whose FT changed (a "."
+ *     that stays "." is not a change), or -1 if new_filter_data could not be allocated.
+ *     */
+static inline int hgsc_fill_ft(hgsc_decode_t *ctx, int nsamples, int min_depth)
+{
+    const char **new_filter_data = hgsc_decode_new_ft(ctx, nsamples);
+    if (new_filter_data == NULL)
+        return -1;
+
+    if (ctx->gt_ploidy == 1)
+        return hgsc_fill_ft_1(ctx, new_filter_data, nsamples, min_depth, 1);
+    if (ctx->gt_ploidy == 2)
+        return hgsc_fill_ft_2(ctx, new_filter_data, nsamples, min_depth, 2);
+    return hgsc_fill_ft_n(ctx, new_filter_data, nsamples, min_depth, ctx->gt_ploidy);
+}
+
+static inline void hgsc_decode_destroy(hgsc_decode_t *ctx)
+{
+    if (ctx->filter_data)
+    {
+        free(ctx->filter_data[0]);
+        free(ctx->filter_data);
+    }
+    free(ctx->gt_data);
+    free(ctx->depth_data);
+    free(ctx->new_filter_data);
+    free(ctx->ft_codes);
+    free(ctx->gt_packed);
+    free(ctx->depth_packed);
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+/*
+ *     Append num / den with 6 decimals, exactly as printf("%lf", num / (double) den) would put it. num >= 0, den > 0,
+ *     and both fit in 32 bits, signed or not. The rounding is done on the exact quotient in integers; only a quotient
+ *     that lands exactly halfway between two outputs needs the double, to see which side of the halfway point printf
+ *     was given.
+ *     */
+static inline void hgsc_kput_ratio6(int64_t num, int64_t den, kstring_t *s)
+{
+    int64_t scaled = (int64_t) num * 1000000;
+    int64_t q = scaled / den;
+    int64_t rem = scaled % den;
+    if (2 * rem > den)
+    {
+        q++;
+    }
+    else if (2 * rem == den)
+    {
+        double residual = fma(-(num / (double) den), den, num);  // exact, so its sign says whether the double was rounded down
+        if (residual < 0 || (residual == 0 && (q & 1)))  // an exact tie is rounded to even, as printf does
+            q++;
+    }
+
+    char frac[6];
+    int i, digits = q % 1000000;
+    for (i = 5; i >= 0; i--, digits /= 10)
+        frac[i] = '0' + digits % 10;
+
+    kputl(q / 1000000, s);
+    kputc('.', s);
+    kputsn(frac, 6, s);
+}
+
+#endif
@@ -1,13 +1,18 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <htslib/vcf.h>
+#include "HGSC_common.h"
 
 int nsamples, nsnps, nindels, nmnps, nothers, nsites;
 
 int min_depth;
 
 bcf_hdr_t *header;
+hgsc_decode_t decode;
+hgsc_stats_t stats;  // --stats, see HGSC_stats.h
+
 /*
  *     This short description is used to generate the output of `bcftools plugin -l`.
  *     */
@@ -22,7 +27,8 @@ const char *about(void)
            "* Else write \"No_var\" if the \"GT\" subfield is \"0/0\" and \"DP\" is >= $MIN_DEPTH\n"
            "* Else write \"No_data\" if the \"GT\" subfield is \"0/0\" and \"DP\" is < $MIN_DEPTH\n"
            "This step will also change the \"GT\" subfield to \"./.\" if the \"FT\"\n"
-           "subfield was marked as \"No_data.\"\n";
+           "subfield was marked as \"No_data.\"\n"
+           "--stats prints where the time went to stderr at the end, and --stats-json FILE writes it to FILE as JSON.\n";
 }
 
 /*
@@ -31,9 +37,11 @@ const char *about(void)
  *         */
 int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
 {
+    hgsc_stats_init(&stats, "HGSC_filt_w_dotdots", &argc, argv, in);
     nsamples = bcf_hdr_nsamples(in);
     nsnps = nindels = nmnps = nothers = nsites = 0;
     header = in;
+    decode.stats = &stats;
    
     if (argc < 1)
     {
@@ -49,71 +57,124 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
         printf("Invalid input.\n");
         exit(1);
     }
+
+    if (hgsc_decode_new_ft(&decode, nsamples) == NULL)
+    {
+        fprintf(stderr, "Could not allocate FT buffer for %d samples.\n", nsamples);
+        exit(1);
+    }
  
+    hgsc_stats_lap(&stats, HGSC_PHASE_SETUP);
     //return 1;
     return 0;
 }
 
 
 /*
- *     Called for each VCF record. Return rec to output the line or NULL
- *         to suppress output.
- *         */
-bcf1_t *process(bcf1_t *rec)
+ *     Write FT for the samples hgsc_fill_ft() changed straight into the packed FORMAT data. Returns 0 if every new
+ *     value fit in the record's existing FT width, -1 (having changed nothing) if FT has to be re-encoded.
+ *     */
+int patch_ft(bcf_fmt_t *fmt)
 {
-    int num_returned;
+    if (fmt == NULL || fmt->type != BCF_BT_CHAR)
+        return -1;
 
-    char **filter_data = NULL;
-    int32_t num_filter_data = 0;
-    num_returned = bcf_get_format_string(header, rec, "FT", &filter_data, &num_filter_data);
+    const char **new_filter_data = decode.new_filter_data;
+    const uint8_t *ft_codes = decode.ft_codes;
+    int i;
+    for (i = 0; i < nsamples; i++)
+    {
+        if (ft_codes[i] != HGSC_FT_NFLT && new_filter_data[i] != decode.filter_data[i] && strlen(new_filter_data[i]) > fmt->n)
+            return -1;
+    }
 
-    int32_t *gt_data = NULL;
-    int32_t num_gt_data = 0;
-    num_returned = bcf_get_genotypes(header, rec, &gt_data, &num_gt_data);
+    for (i = 0; i < nsamples; i++)
+    {
+        if (ft_codes[i] == HGSC_FT_NFLT || new_filter_data[i] == decode.filter_data[i])
+            continue;
+
+        // strings are NUL-padded to the width of the widest one
+        char *dst = (char *) fmt->p + (size_t) i * fmt->n;
+        size_t len = strlen(new_filter_data[i]);
+        memcpy(dst, new_filter_data[i], len);
+        memset(dst + len, 0, fmt->n - len);
+    }
+    return 0;
+}
 
-    int32_t *depth_data = NULL;
-    int32_t num_depth_data = 0;
-    num_returned = bcf_get_format_int32(header, rec, "DP", &depth_data, &num_depth_data);
- 
-    const char **new_filter_data = calloc(nsamples, sizeof(char*));
+/*
+ *     Set GT to missing in the packed FORMAT data for the samples hgsc_fill_ft() made missing, at any ploidy. Missing
+ *     is 0 at every integer width, so this always fits, and the vector_end that pads a haploid sample in a diploid
+ *     record is left alone. Returns -1 (having changed nothing) if GT isn't packed as integers.
+ *     */
+int patch_gt(bcf_fmt_t *fmt)
+{
+    int n = decode.gt_ploidy;
+    if (fmt == NULL || n <= 0 || fmt->n != n)
+        return -1;
 
-    int i;
+    const int32_t *gt_data = decode.gt_data;
+    const uint8_t *ft_codes = decode.ft_codes;
+    int i, j;
     for (i = 0; i < nsamples; i++)
     {
-        int all1 = bcf_gt_allele(gt_data[2*i + 0]);
-        int all2 = bcf_gt_allele(gt_data[2*i + 1]);
+        if (ft_codes[i] != HGSC_FT_NDAT || decode.new_filter_data[i] == decode.filter_data[i])
+            continue;
 
-        if(strcmp(filter_data[i], ".") != 0)
-            new_filter_data[i] = filter_data[i];
-        else if (all1 == 0 && all2 == 0) 
+        // values that were already missing get the same value written back
+        for (j = 0; j < n; j++)
         {
-            if (depth_data[i] < min_depth)
+            size_t k = (size_t) n*i + j;
+            if (gt_data[k] != bcf_gt_missing)
+                continue;
+            switch (fmt->type)
             {
-                gt_data[2*i + 0] = bcf_gt_missing;
-                gt_data[2*i + 1] = bcf_gt_missing;
-
-                new_filter_data[i] = "No_data";
+                case BCF_BT_INT8: ((int8_t *) fmt->p)[k] = 0; break;
+                case BCF_BT_INT16: ((int16_t *) fmt->p)[k] = 0; break;
+                case BCF_BT_INT32: ((int32_t *) fmt->p)[k] = 0; break;
+                default: return -1;  // only possible before anything was written
             }
-            else
-                new_filter_data[i] = "No_var"; 
         }
-        else if (all1 < 0 && all2 >= 0)
-            new_filter_data[i] = ".";
-        else if (all1 < 0 && all2 < 0)
-            new_filter_data[i] = "No_data";
-        else
-            new_filter_data[i] = "PASS";
     }
- 
-    bcf_update_format_string(header, rec, "FT", new_filter_data, nsamples);
-    free(filter_data[0]);
-    free(filter_data);
+    return 0;
+}
+
+
+/*
+ *     Called for each VCF record. Return rec to output the line or NULL
+ *         to suppress output.
+ *         */
+bcf1_t *process(bcf1_t *rec)
+{
+    hgsc_stats_lap(&stats, HGSC_PHASE_BCFTOOLS);
+    hgsc_stats_record(&stats, rec->rid, rec->pos);
+    int num_returned;
+
+    num_returned = hgsc_decode_ft_codes(&decode, header, rec, nsamples);
+    if (!hgsc_any_ft(&decode, nsamples, HGSC_FT_BIT(HGSC_FT_NFLT)))
+        return rec;  // every sample already has an FT, so GT and DP aren't needed
+
+    num_returned = hgsc_decode_gt(&decode, header, rec);
+    int32_t *gt_data = decode.gt_data;
+    int32_t num_gt_data = num_returned;
+
+    // a record without DP (num_returned <= 0) clears decode.has_depth, so hgsc_fill_ft() doesn't read the last
+    // record's depths
+    num_returned = hgsc_decode_dp(&decode, header, rec);
+
+    // can't fail, new_filter_data was allocated in init()
+    int nfilled = hgsc_fill_ft(&decode, nsamples, min_depth);
+    hgsc_stats_lap(&stats, HGSC_PHASE_COUNT);
+    if (nfilled == 0)
+        return rec;  // every sample already had an FT, so there's nothing to rewrite
 
-    bcf_update_genotypes(header, rec, gt_data, num_gt_data); 
+    // GT first: re-encoding FT can move the FORMAT entries around
+    if (patch_gt(bcf_get_fmt(header, rec, "GT")) != 0)
+        bcf_update_genotypes(header, rec, gt_data, num_gt_data); 
 
-    free(gt_data);
-    free(depth_data);
-    free(new_filter_data);
+    if (patch_ft(bcf_get_fmt(header, rec, "FT")) != 0)
+        bcf_update_format_string(header, rec, "FT", decode.new_filter_data, nsamples);
+    hgsc_stats_lap(&stats, HGSC_PHASE_UPDATE);
 
     return rec;
 }
@@ -124,5 +185,8 @@ bcf1_t *process(bcf1_t *rec)
  *     */
 void destroy(void)
 {
+    hgsc_stats_lap(&stats, HGSC_PHASE_BCFTOOLS);
+    hgsc_decode_destroy(&decode);
+    hgsc_stats_report(&stats);
 }
 
@@ -0,0 +1,275 @@
+/*
+ *     Pairwise identity-by-state counts for HGSC_sample_summary --ibs. Each genotype is reduced to two bits, one in each
+ *     of two bit planes:
+ *
+ *         class      X (has REF)   Y (has ALT)
+ *         missing    0             0
+ *         0/0        1             0
+ *         het        1             1
+ *         hom-var    0             1
+ *
+ *     For samples a and b at a site, both are called when (Xa | Ya) & (Xb | Yb). They are IBS2 when both are called
+ *     and neither plane differs. They are IBS0 (0/0 against hom-var) when both are called and both planes differ.
+ *     Everything else that is called by both is IBS1. With 64 sites to a word, that is a few ANDs and XORs and three
+ *     popcounts per pair per 64 sites.
+ *
+ *     Sites are packed into blocks of HGSC_IBS_BLOCK_SITES, stored sample by sample. A full block is counted HGSC_IBS_TILE
+ *     samples against HGSC_IBS_TILE samples at a time, so both tiles' planes stay in cache while every pair between
+ *     them is counted. There are two blocks so one can be filled while the other is counted on a worker pool.
+ *     */
+#ifndef HGSC_IBS_H
+#define HGSC_IBS_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HGSC_IBS_X86 1
+#endif
+
+#define HGSC_IBS_BLOCK_WORDS 32  // 64-bit words per sample per plane; the AVX2 kernel's byte counters need <= 124
+#define HGSC_IBS_BLOCK_SITES (64 * HGSC_IBS_BLOCK_WORDS)
+#define HGSC_IBS_TILE 64  // samples per tile: two tiles of planes are 64 KB
+
+// Genotype classes, as their X and Y bits
+#define HGSC_IBS_MISSING 0
+#define HGSC_IBS_HOMREF 1
+#define HGSC_IBS_HOMVAR 2
+#define HGSC_IBS_HET 3
+
+// Counters kept for every pair; IBS1 is CALLED - IBS0 - IBS2
+#define HGSC_IBS_CALLED 0
+#define HGSC_IBS_IBS0 1
+#define HGSC_IBS_IBS2 2
+#define HGSC_IBS_NCOUNTS 3
+
+typedef struct hgsc_ibs_t hgsc_ibs_t;
+
+// Count every pair (a, b) with a in [a_start, a_end), b in [b_start, b_end) and a < b over the first nwords words
+typedef void (*hgsc_ibs_tile_fn)(hgsc_ibs_t *ibs, const uint64_t *planes, int nwords, int a_start, int a_end,
+                                 int b_start, int b_end);
+
+typedef struct
+{
+    hgsc_ibs_t *ibs;
+    uint64_t *planes;  // for each sample, HGSC_IBS_BLOCK_WORDS words of X and then of Y
+    int nsites;
+} hgsc_ibs_block_t;
+
+struct hgsc_ibs_t
+{
+    int n;  // samples
+    uint32_t *counts;  // HGSC_IBS_NCOUNTS for each pair (a, b) with a < b, pairs ordered by a and then b
+    size_t npairs;
+    hgsc_ibs_block_t blocks[2];
+    int cur;  // block being filled
+    hgsc_ibs_tile_fn tile;  // the fastest tile kernel this CPU supports
+};
+
+/*
+ *     Position of pair (a, b), a < b, in counts.
+ *     */
+static inline size_t hgsc_ibs_pair_index(const hgsc_ibs_t *ibs, int a, int b)
+{
+    return (size_t) a * ibs->n - (size_t) a * (a + 1) / 2 + (b - a - 1);
+}
+
+// hgsc_ibs_pair_generic/_popcnt: one pair over nwords words. The generic one is for CPUs without POPCNT.
+#define HGSC_IBS_PAIR_SCALAR(name, attr) \
+attr static inline void hgsc_ibs_pair_##name(const uint64_t *a, const uint64_t *b, int nwords, uint32_t *counts) \
+{ \
+    uint32_t called = 0, ibs0 = 0, ibs2 = 0; \
+    int w; \
+    for (w = 0; w < nwords; w++) \
+    { \
+        uint64_t xa = a[w], ya = a[HGSC_IBS_BLOCK_WORDS + w]; \
+        uint64_t xb = b[w], yb = b[HGSC_IBS_BLOCK_WORDS + w]; \
+        uint64_t both = (xa | ya) & (xb | yb), dx = xa ^ xb, dy = ya ^ yb; \
+        called += __builtin_popcountll(both); \
+        ibs0 += __builtin_popcountll(both & dx & dy); \
+        ibs2 += __builtin_popcountll(both & ~(dx | dy)); \
+    } \
+    counts[HGSC_IBS_CALLED] += called; \
+    counts[HGSC_IBS_IBS0] += ibs0; \
+    counts[HGSC_IBS_IBS2] += ibs2; \
+}
+
+// hgsc_ibs_tile_generic/_popcnt/_avx2
+#define HGSC_IBS_TILE_KERNEL(name, attr) \
+attr static void hgsc_ibs_tile_##name(hgsc_ibs_t *ibs, const uint64_t *planes, int nwords, int a_start, int a_end, \
+                                      int b_start, int b_end) \
+{ \
+    int a, b; \
+    for (a = a_start; a < a_end; a++) \
+    { \
+        const uint64_t *pa = planes + (size_t) a * 2 * HGSC_IBS_BLOCK_WORDS; \
+        int first = b_start > a ? b_start : a + 1; \
+        if (first >= b_end) \
+            continue; \
+        uint32_t *counts = ibs->counts + hgsc_ibs_pair_index(ibs, a, first) * HGSC_IBS_NCOUNTS; \
+        for (b = first; b < b_end; b++, counts += HGSC_IBS_NCOUNTS) \
+            hgsc_ibs_pair_##name(pa, planes + (size_t) b * 2 * HGSC_IBS_BLOCK_WORDS, nwords, counts); \
+    } \
+}
+
+HGSC_IBS_PAIR_SCALAR(generic, )
+HGSC_IBS_TILE_KERNEL(generic, )
+
+#ifdef HGSC_IBS_X86
+HGSC_IBS_PAIR_SCALAR(popcnt, __attribute__((target("popcnt"))))
+HGSC_IBS_TILE_KERNEL(popcnt, __attribute__((target("popcnt"))))
+
+// Popcount of each byte, by looking up each nibble
+__attribute__((target("avx2"))) static inline __m256i hgsc_ibs_popcount_bytes(__m256i v)
+{
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    return _mm256_add_epi8(_mm256_shuffle_epi8(lookup, _mm256_and_si256(v, nibble)),
+                           _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble)));
+}
+
+__attribute__((target("avx2"))) static inline uint32_t hgsc_ibs_sum_bytes(__m256i bytes)
+{
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *) lanes, _mm256_sad_epu8(bytes, _mm256_setzero_si256()));
+    return (uint32_t) (lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+}
+
+// 4 words at a time. nwords is a multiple of 4, and each byte counter gains at most 8 per step, so a block's worth
+// (HGSC_IBS_BLOCK_WORDS / 4 steps) can't overflow before the final sum.
+__attribute__((target("avx2"))) static inline void hgsc_ibs_pair_avx2(const uint64_t *a, const uint64_t *b, int nwords,
+                                                                      uint32_t *counts)
+{
+    __m256i called = _mm256_setzero_si256(), ibs0 = called, ibs2 = called;
+    int w;
+    for (w = 0; w < nwords; w += 4)
+    {
+        __m256i xa = _mm256_loadu_si256((const __m256i *) (a + w));
+        __m256i ya = _mm256_loadu_si256((const __m256i *) (a + HGSC_IBS_BLOCK_WORDS + w));
+        __m256i xb = _mm256_loadu_si256((const __m256i *) (b + w));
+        __m256i yb = _mm256_loadu_si256((const __m256i *) (b + HGSC_IBS_BLOCK_WORDS + w));
+        __m256i both = _mm256_and_si256(_mm256_or_si256(xa, ya), _mm256_or_si256(xb, yb));
+        __m256i dx = _mm256_xor_si256(xa, xb), dy = _mm256_xor_si256(ya, yb);
+        called = _mm256_add_epi8(called, hgsc_ibs_popcount_bytes(both));
+        ibs0 = _mm256_add_epi8(ibs0, hgsc_ibs_popcount_bytes(_mm256_and_si256(both, _mm256_and_si256(dx, dy))));
+        ibs2 = _mm256_add_epi8(ibs2, hgsc_ibs_popcount_bytes(_mm256_andnot_si256(_mm256_or_si256(dx, dy), both)));
+    }
+    counts[HGSC_IBS_CALLED] += hgsc_ibs_sum_bytes(called);
+    counts[HGSC_IBS_IBS0] += hgsc_ibs_sum_bytes(ibs0);
+    counts[HGSC_IBS_IBS2] += hgsc_ibs_sum_bytes(ibs2);
+}
+HGSC_IBS_TILE_KERNEL(avx2, __attribute__((target("avx2"))))
+#endif
+
+/*
+ *     Allocate zeroed counters for n samples and the two blocks. Return 0 on success.
+ *     */
+static inline int hgsc_ibs_init(hgsc_ibs_t *ibs, int n)
+{
+    memset(ibs, 0, sizeof(*ibs));
+    ibs->n = n;
+    ibs->npairs = (size_t) n * (n - 1) / 2;
+    ibs->counts = calloc(ibs->npairs * HGSC_IBS_NCOUNTS + 1, sizeof(uint32_t));  // + 1 so n < 2 still allocates
+    ibs->blocks[0].planes = calloc((size_t) n * 2 * HGSC_IBS_BLOCK_WORDS + 1, sizeof(uint64_t));
+    ibs->blocks[1].planes = calloc((size_t) n * 2 * HGSC_IBS_BLOCK_WORDS + 1, sizeof(uint64_t));
+    if (ibs->counts == NULL || ibs->blocks[0].planes == NULL || ibs->blocks[1].planes == NULL)
+    {
+        free(ibs->counts);
+        free(ibs->blocks[0].planes);
+        free(ibs->blocks[1].planes);
+        return -1;
+    }
+    ibs->blocks[0].ibs = ibs;
+    ibs->blocks[1].ibs = ibs;
+
+    ibs->tile = hgsc_ibs_tile_generic;
+#ifdef HGSC_IBS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        ibs->tile = hgsc_ibs_tile_avx2;
+    else if (__builtin_cpu_supports("popcnt"))
+        ibs->tile = hgsc_ibs_tile_popcnt;
+#endif
+    return 0;
+}
+
+static inline void hgsc_ibs_destroy(hgsc_ibs_t *ibs)
+{
+    free(ibs->counts);
+    free(ibs->blocks[0].planes);
+    free(ibs->blocks[1].planes);
+}
+
+/*
+ *     Set the class of sample i at the site being packed. Samples left alone are missing.
+ *     */
+static inline void hgsc_ibs_set(hgsc_ibs_t *ibs, int i, int cls)
+{
+    hgsc_ibs_block_t *block = &ibs->blocks[ibs->cur];
+    uint64_t *x = block->planes + (size_t) i * 2 * HGSC_IBS_BLOCK_WORDS + block->nsites / 64;
+    int bit = block->nsites % 64;
+    x[0] |= (uint64_t) (cls & 1) << bit;
+    x[HGSC_IBS_BLOCK_WORDS] |= (uint64_t) (cls >> 1) << bit;
+}
+
+/*
+ *     Finish the site being packed. Returns 1 when that filled the block, which must then be counted with
+ *     hgsc_ibs_count_block() before calling hgsc_ibs_swap().
+ *     */
+static inline int hgsc_ibs_next_site(hgsc_ibs_t *ibs)
+{
+    return ++ibs->blocks[ibs->cur].nsites == HGSC_IBS_BLOCK_SITES;
+}
+
+/*
+ *     Start packing into the other block. Its last count must be done by now.
+ *     */
+static inline void hgsc_ibs_swap(hgsc_ibs_t *ibs)
+{
+    ibs->cur ^= 1;
+    hgsc_ibs_block_t *block = &ibs->blocks[ibs->cur];
+    memset(block->planes, 0, (size_t) ibs->n * 2 * HGSC_IBS_BLOCK_WORDS * sizeof(uint64_t));
+    block->nsites = 0;
+}
+
+/*
+ *     Add the pairs of block arg (an hgsc_ibs_block_t) to the counters. Matches hgsc_pool_fn: worker `thread` of
+ *     `nthreads` counts its share of the tile pairs, and every tile pair has counters of its own, so the workers
+ *     never write to the same ones.
+ *     */
+static void hgsc_ibs_count_block(void *arg, int thread, int nthreads)
+{
+    hgsc_ibs_block_t *block = arg;
+    hgsc_ibs_t *ibs = block->ibs;
+    if (block->nsites == 0)
+        return;
+
+    int nwords = (block->nsites + 255) / 256 * 4;  // the AVX2 kernel takes 4 words at a time
+    int ntiles = (ibs->n + HGSC_IBS_TILE - 1) / HGSC_IBS_TILE;
+    long ntile_pairs = (long) ntiles * (ntiles + 1) / 2;
+    long start = ntile_pairs * thread / nthreads, end = ntile_pairs * (thread + 1) / nthreads;
+
+    // find tile pair `start`: row i holds tile pairs (i, i) to (i, ntiles - 1)
+    int ti = 0;
+    long t = 0;
+    while (t + (ntiles - ti) <= start)
+        t += ntiles - ti++;
+    int tj = ti + (int) (start - t);
+
+    for (t = start; t < end; t++)
+    {
+        int a_end = (ti + 1) * HGSC_IBS_TILE, b_end = (tj + 1) * HGSC_IBS_TILE;
+        ibs->tile(ibs, block->planes, nwords, ti * HGSC_IBS_TILE, a_end < ibs->n ? a_end : ibs->n,
+                  tj * HGSC_IBS_TILE, b_end < ibs->n ? b_end : ibs->n);
+        if (++tj == ntiles)
+        {
+            ti++;
+            tj = ti;
+        }
+    }
+}
+
+#endif
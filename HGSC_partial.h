@@ -0,0 +1,101 @@
+/*
+ *     Partial-state files for the summary plugins. A partial holds the accumulators of one run over part of a file
+ *     (e.g. one chromosome or -r interval) so several runs can be gathered into the same output as a single pass.
+ *
+ *     A partial is a BGZF stream: an 8-byte magic that names the plugin and format version, the sample count, the
+ *     NUL-terminated sample names, and then whatever the plugin writes. Numbers are stored in native byte order, so
+ *     partials are meant to be merged on the same kind of machine that wrote them.
+ *     */
+#ifndef HGSC_PARTIAL_H
+#define HGSC_PARTIAL_H
+
+#include <string.h>
+#include <stdint.h>
+#include <htslib/vcf.h>
+#include <htslib/bgzf.h>
+#include "bcftools.h"
+
+#define HGSC_PARTIAL_MAGIC_LEN 8
+
+typedef struct
+{
+    BGZF *fp;
+    const char *fname;
+} hgsc_partial_t;
+
+static inline void hgsc_partial_write(hgsc_partial_t *part, const void *data, size_t len)
+{
+    if (bgzf_write(part->fp, data, len) != (ssize_t) len)
+        error("Could not write to %s\n", part->fname);
+}
+
+static inline void hgsc_partial_read(hgsc_partial_t *part, void *data, size_t len)
+{
+    if (bgzf_read(part->fp, data, len) != (ssize_t) len)
+        error("%s is truncated\n", part->fname);
+}
+
+/*
+ *     Create fname and write the magic and the samples of hdr.
+ *     */
+static inline void hgsc_partial_create(hgsc_partial_t *part, const char *fname, const char *magic, const bcf_hdr_t *hdr)
+{
+    part->fname = fname;
+    part->fp = bgzf_open(fname, "w");
+    if (part->fp == NULL)
+        error("Could not create %s\n", fname);
+
+    hgsc_partial_write(part, magic, HGSC_PARTIAL_MAGIC_LEN);
+
+    int32_t nsamples = bcf_hdr_nsamples(hdr);
+    hgsc_partial_write(part, &nsamples, sizeof(nsamples));
+
+    int i;
+    for (i = 0; i < nsamples; i++)
+        hgsc_partial_write(part, hdr->samples[i], strlen(hdr->samples[i]) + 1);
+}
+
+/*
+ *     Open fname and check that it was written by the same plugin, for the same samples in the same order as hdr.
+ *     */
+static inline void hgsc_partial_open(hgsc_partial_t *part, const char *fname, const char *magic, const bcf_hdr_t *hdr)
+{
+    part->fname = fname;
+    part->fp = bgzf_open(fname, "r");
+    if (part->fp == NULL)
+        error("Could not open %s\n", fname);
+
+    char file_magic[HGSC_PARTIAL_MAGIC_LEN];
+    hgsc_partial_read(part, file_magic, HGSC_PARTIAL_MAGIC_LEN);
+    if (memcmp(file_magic, magic, HGSC_PARTIAL_MAGIC_LEN) != 0)
+        error("%s is not a partial written by this plugin\n", fname);
+
+    int32_t nsamples;
+    hgsc_partial_read(part, &nsamples, sizeof(nsamples));
+    if (nsamples != bcf_hdr_nsamples(hdr))
+        error("%s has %d samples but the input has %d\n", fname, nsamples, bcf_hdr_nsamples(hdr));
+
+    int i;
+    for (i = 0; i < nsamples; i++)
+    {
+        const char *name = hdr->samples[i];
+        size_t len = strlen(name) + 1;
+        size_t j;
+        for (j = 0; j < len; j++)
+        {
+            char c;
+            hgsc_partial_read(part, &c, 1);
+            if (c != name[j])
+                error("Sample %d of %s does not match sample %s of the input\n", i + 1, fname, name);
+        }
+    }
+}
+
+static inline void hgsc_partial_close(hgsc_partial_t *part)
+{
+    if (bgzf_close(part->fp) != 0)
+        error("Could not close %s\n", part->fname);
+    part->fp = NULL;
+}
+
+#endif
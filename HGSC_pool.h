@@ -0,0 +1,171 @@
+/*
+ *     A minimal fixed-size worker pool for the HGSC plugins. Every job runs on all workers at once: fn(arg, i, n) is
+ *     called on worker i of n, and the job decides how to split its work between them. Only one job is in flight at a
+ *     time, which lets process() fill the next batch of records while the workers count the previous one.
+ *     */
+#ifndef HGSC_POOL_H
+#define HGSC_POOL_H
+
+#include <stdlib.h>
+#include <pthread.h>
+
+typedef void (*hgsc_pool_fn)(void *arg, int thread, int nthreads);
+
+typedef struct hgsc_pool_t hgsc_pool_t;
+
+typedef struct
+{
+    hgsc_pool_t *pool;
+    int index;
+} hgsc_pool_worker_t;
+
+struct hgsc_pool_t
+{
+    int nthreads;
+    pthread_t *threads;
+    hgsc_pool_worker_t *workers;
+    pthread_mutex_t lock;
+    pthread_cond_t start_cond;  // signalled when a new job is posted
+    pthread_cond_t done_cond;  // signalled when the last worker finishes the current job
+    hgsc_pool_fn fn;
+    void *arg;
+    unsigned int generation;  // bumped for every job
+    int running;  // workers that haven't finished the current job yet
+    int shutdown;
+};
+
+static void *hgsc_pool_worker(void *data)
+{
+    hgsc_pool_worker_t *worker = data;
+    hgsc_pool_t *pool = worker->pool;
+    unsigned int seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1)
+    {
+        while (pool->generation == seen && !pool->shutdown)
+            pthread_cond_wait(&pool->start_cond, &pool->lock);
+        if (pool->shutdown)
+            break;
+
+        seen = pool->generation;
+        hgsc_pool_fn fn = pool->fn;
+        void *arg = pool->arg;
+        pthread_mutex_unlock(&pool->lock);
+
+        fn(arg, worker->index, pool->nthreads);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->running == 0)
+            pthread_cond_signal(&pool->done_cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+/*
+ *     Block until the current job (if any) has finished on every worker.
+ *     */
+static inline void hgsc_pool_wait(hgsc_pool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (pool->running > 0)
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ *     Run fn(arg, i, nthreads) on every worker and return without waiting for it. Waits for the previous job first.
+ *     */
+static inline void hgsc_pool_start(hgsc_pool_t *pool, hgsc_pool_fn fn, void *arg)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (pool->running > 0)
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    pool->fn = fn;
+    pool->arg = arg;
+    pool->running = pool->nthreads;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start_cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static inline void hgsc_pool_destroy(hgsc_pool_t *pool)
+{
+    if (pool == NULL)
+        return;
+
+    hgsc_pool_wait(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->start_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    int i;
+    for (i = 0; i < pool->nthreads; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start_cond);
+    pthread_cond_destroy(&pool->done_cond);
+    free(pool->threads);
+    free(pool->workers);
+    free(pool);
+}
+
+/*
+ *     Start nthreads workers. Returns NULL on failure.
+ *     */
+static inline hgsc_pool_t *hgsc_pool_init(int nthreads)
+{
+    hgsc_pool_t *pool = calloc(1, sizeof(hgsc_pool_t));
+    if (pool == NULL)
+        return NULL;
+
+    pool->nthreads = nthreads;
+    pool->threads = calloc(nthreads, sizeof(pthread_t));
+    pool->workers = calloc(nthreads, sizeof(hgsc_pool_worker_t));
+    if (pool->threads == NULL || pool->workers == NULL)
+    {
+        free(pool->threads);
+        free(pool->workers);
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+
+    int i;
+    for (i = 0; i < nthreads; i++)
+    {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        if (pthread_create(&pool->threads[i], NULL, hgsc_pool_worker, &pool->workers[i]) != 0)
+            break;
+    }
+
+    if (i < nthreads)
+    {
+        // shut down the ones that did start
+        pool->nthreads = i;
+        hgsc_pool_destroy(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+/*
+ *     The [start, end) share of n items that worker `thread` of `nthreads` should handle.
+ *     */
+static inline void hgsc_pool_range(int n, int thread, int nthreads, int *start, int *end)
+{
+    *start = (int) ((long) n * thread / nthreads);
+    *end = (int) ((long) n * (thread + 1) / nthreads);
+}
+
+#endif
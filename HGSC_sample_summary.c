@@ -1,24 +1,45 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
+#include <math.h>
 #include <getopt.h>
 #include <htslib/vcf.h>
 #include <htslib/vcfutils.h>
+#include "bcftools.h"
+#include "HGSC_common.h"
+#include "HGSC_pool.h"
+#include "HGSC_partial.h"
+#include "HGSC_columnar.h"
+#include "HGSC_ibs.h"
+#include "HGSC_cache.h"
 
 #define MAX_COVERAGE 1000   //coverage values above this won't be used for calculating the average
 #define MIN_COVERAGE 0      //coverage values below this won't be used for calculating the average
+#define RECORDS_PER_THREAD 8  //records handed to each worker per batch with --threads
+#define PARTIAL_MAGIC "HGSCss\x00\x01"  //HGSC_partial.h file written by this plugin, format version 1
+#define DEPTH_EXACT_BITS 7  //--depth-stats: DP below 1 << this gets a bin per value
+#define DEPTH_EXACT_BINS (1 << DEPTH_EXACT_BITS)
+#define DEPTH_STEP_BITS 2
+#define DEPTH_STEPS (1 << DEPTH_STEP_BITS)  //bins per power of two above that, so those bins are at most 25% wide
+#define DEPTH_BINS (DEPTH_EXACT_BINS + (31 - DEPTH_EXACT_BITS) * DEPTH_STEPS)  //enough for any int32 DP
+#define DEPTH_THRESHOLDS "10,20,30"  //default --depth-thresholds
+#define IBS_MERGE_CHUNK 65536  //--merge: pair counters read from a partial at a time
 
+// Per-sample counters, stored as one array per counter (indexed by sample) so the per-record loop walks each
+// array linearly. All arrays are carved out of a single allocation, see buckets_alloc().
 typedef struct
 {
-    int genotypes_with_depth;
-    int passing_variants;
-    int ref;  // 0/0
-    int het;  // 0/1, 0/2, etc.
-    int var;  // 1/1, 1/2, 2/2, etc.
-    int missing;  // ./., ./0, 1/., etc.
-    int transitions;
-    int transversions;
-    long total_coverage;  // divide this by genotypes_with_depth sites to get average coverage
+    long *total_coverage;  // divide this by genotypes_with_depth sites to get average coverage
+    int *genotypes_with_depth;
+    int *passing_variants;
+    int *ref;  // 0/0
+    int *het;  // 0/1, 0/2, etc.
+    int *var;  // 1/1, 1/2, 2/2, etc.
+    int *missing;  // ./., ./0, 1/., etc.
+    int *transitions;
+    int *transversions;
+    int *depth_hist;  // --depth-stats: DEPTH_BINS counts per sample, sample by sample; NULL otherwise
 } bucket_t;
 
 typedef struct
@@ -26,14 +47,216 @@ typedef struct
     bool use_pass;
     bool use_fail;
     bool is_indel_file;
+    bool use_coverage;  // false with --no-coverage: DP is never decoded and the coverage columns are left out
+    bool depth_stats;  // --depth-stats: keep a DP histogram per sample for the percentile columns
+    int *depth_thresholds;  // --depth-thresholds: report the fraction of depths at or above each of these
+    int n_depth_thresholds;
+    int nthreads;
+    char *partial_fname;  // --write-partial: save the counters here instead of printing them
+    char *columnar_fname;  // --columnar: write the table here as typed columns instead of printing it
+    char *ibs_fname;  // --ibs: write the pairwise IBS counts here
+    char *cache_fname;  // --from-cache: count the sites of this HGSC_build_cache file before the input's records
 } args_t;
 
+// A record decoded by process() and waiting to be counted.
+typedef struct
+{
+    hgsc_decode_t decode;
+    bool skip;  // no sample is counted at this site, so only FT was decoded
+    int decoded;  // HGSC_FIELD_* flags of the fields that could be read
+    int *allele_bases;  // bcf_acgt2int() of each allele, for ti/tv
+    int n_allele;
+    int m_allele;
+} record_t;
+
+typedef struct
+{
+    record_t *records;
+    int n;
+} batch_t;
+
 int nsamples;
 int num_sites;
 bcf_hdr_t *header;
-bucket_t **samp_buckets;
+bucket_t samp_buckets;
 args_t *args;
+hgsc_pool_t *pool;  // NULL unless --threads was given
+bucket_t *thread_buckets;  // one set of counters per worker, merged into samp_buckets in destroy()
+batch_t batches[2];  // process() fills one while the workers count the other
+int cur_batch;
+int batch_size;
+char **columns;  // names and HGSC_COL_* types of the output columns
+int *column_types;
+int ncolumns;
+int row_column;  // values already output on the current row
+hgsc_columnar_t columnar;
+hgsc_ibs_t ibs;  // --ibs: genotype bit planes and pair counters
+FILE *ibs_fp;  // --ibs: opened up front so a bad path fails before the whole input is read
+hgsc_stats_t stats;  // --stats, see HGSC_stats.h
+
+void read_cache(const char *fname);  // init() runs --from-cache through the same batches as process(), see below
+
+
+/*
+ *     Allocate zeroed counters for n samples in one contiguous block, plus the DP histograms with --depth-stats.
+ *     Return 0 on success.
+ *     */
+int buckets_alloc(bucket_t *buckets, int n)
+{
+    buckets->depth_hist = NULL;
+    if (args->depth_stats)
+    {
+        buckets->depth_hist = calloc((size_t) n * DEPTH_BINS, sizeof(int));
+        if (buckets->depth_hist == NULL)
+            return -1;
+    }
+
+    // longs first so every array stays naturally aligned
+    char *block = calloc(n, sizeof(long) + 8 * sizeof(int));
+    if (block == NULL)
+    {
+        free(buckets->depth_hist);
+        return -1;
+    }
+
+    buckets->total_coverage = (long *) block;
+    int *ints = (int *) (block + n * sizeof(long));
+    buckets->genotypes_with_depth = ints + 0 * n;
+    buckets->passing_variants = ints + 1 * n;
+    buckets->ref = ints + 2 * n;
+    buckets->het = ints + 3 * n;
+    buckets->var = ints + 4 * n;
+    buckets->missing = ints + 5 * n;
+    buckets->transitions = ints + 6 * n;
+    buckets->transversions = ints + 7 * n;
+
+    return 0;
+}
 
+void buckets_free(bucket_t *buckets)
+{
+    free(buckets->total_coverage);
+    free(buckets->depth_hist);
+}
+
+/*
+ *     dst += src, for n samples.
+ *     */
+void buckets_add(bucket_t *dst, const bucket_t *src, int n)
+{
+    int i;
+    for (i = 0; i < n; i++)
+        dst->total_coverage[i] += src->total_coverage[i];
+
+    // the int counters are contiguous, see buckets_alloc()
+    for (i = 0; i < 8 * n; i++)
+        dst->genotypes_with_depth[i] += src->genotypes_with_depth[i];
+
+    if (dst->depth_hist != NULL)
+    {
+        size_t j;
+        for (j = 0; j < (size_t) n * DEPTH_BINS; j++)
+            dst->depth_hist[j] += src->depth_hist[j];
+    }
+}
+
+/*
+ *     The options that decide which genotypes get counted, packed so partials made with different ones can't be merged.
+ *     */
+int32_t count_mode(void)
+{
+    return args->use_pass | args->use_fail << 1 | args->is_indel_file << 2 | !args->use_coverage << 3
+           | args->depth_stats << 4 | (args->ibs_fname != NULL) << 5;
+}
+
+/*
+ *     Save the counters to a partial that --merge can add back in.
+ *     */
+void write_partial(const char *fname)
+{
+    hgsc_partial_t part;
+    hgsc_partial_create(&part, fname, PARTIAL_MAGIC, header);
+
+    int32_t mode = count_mode();
+    int32_t sites = num_sites;
+    hgsc_partial_write(&part, &mode, sizeof(mode));
+    hgsc_partial_write(&part, &sites, sizeof(sites));
+    hgsc_partial_write(&part, samp_buckets.total_coverage, nsamples * sizeof(long));
+    hgsc_partial_write(&part, samp_buckets.genotypes_with_depth, 8 * nsamples * sizeof(int));  // contiguous, see buckets_alloc()
+    if (args->depth_stats)
+        hgsc_partial_write(&part, samp_buckets.depth_hist, (size_t) nsamples * DEPTH_BINS * sizeof(int));
+    if (args->ibs_fname != NULL)
+        hgsc_partial_write(&part, ibs.counts, ibs.npairs * HGSC_IBS_NCOUNTS * sizeof(uint32_t));
+
+    hgsc_partial_close(&part);
+}
+
+/*
+ *     Add the counters saved in a partial to samp_buckets.
+ *     */
+void merge_partial(const char *fname)
+{
+    hgsc_partial_t part;
+    hgsc_partial_open(&part, fname, PARTIAL_MAGIC, header);
+
+    int32_t mode, sites;
+    hgsc_partial_read(&part, &mode, sizeof(mode));
+    if (mode != count_mode())
+        error("%s was made with different --fail/--both/--indel/--no-coverage/--depth-stats/--ibs options\n", fname);
+    hgsc_partial_read(&part, &sites, sizeof(sites));
+    num_sites += sites;
+
+    bucket_t saved;
+    if (buckets_alloc(&saved, nsamples) != 0)
+        error("Could not allocate counters for %d samples.\n", nsamples);
+    hgsc_partial_read(&part, saved.total_coverage, nsamples * sizeof(long));
+    hgsc_partial_read(&part, saved.genotypes_with_depth, 8 * nsamples * sizeof(int));
+    if (args->depth_stats)
+        hgsc_partial_read(&part, saved.depth_hist, (size_t) nsamples * DEPTH_BINS * sizeof(int));
+    buckets_add(&samp_buckets, &saved, nsamples);
+    buckets_free(&saved);
+
+    if (args->ibs_fname != NULL)
+    {
+        // in chunks, as there are hundreds of millions of pairs in a large cohort
+        uint32_t *chunk = malloc(IBS_MERGE_CHUNK * sizeof(uint32_t));
+        if (chunk == NULL)
+            error("Could not allocate --ibs counters.\n");
+        size_t done, total = ibs.npairs * HGSC_IBS_NCOUNTS;
+        for (done = 0; done < total; done += IBS_MERGE_CHUNK)
+        {
+            size_t j, n = total - done < IBS_MERGE_CHUNK ? total - done : IBS_MERGE_CHUNK;
+            hgsc_partial_read(&part, chunk, n * sizeof(uint32_t));
+            for (j = 0; j < n; j++)
+                ibs.counts[done + j] += chunk[j];
+        }
+        free(chunk);
+    }
+
+    hgsc_partial_close(&part);
+}
+
+/*
+ *     Parse the comma-separated --depth-thresholds into args.
+ *     */
+void parse_depth_thresholds(const char *list)
+{
+    const char *p = list;
+    char *endptr;
+    args->n_depth_thresholds = 0;
+    while (*p)
+    {
+        long threshold = strtol(p, &endptr, 10);
+        if (endptr == p || (*endptr && *endptr != ',') || threshold < 0 || threshold > INT32_MAX)
+            error("Could not parse --depth-thresholds %s\n", list);
+
+        args->depth_thresholds = realloc(args->depth_thresholds, (args->n_depth_thresholds + 1) * sizeof(int));
+        if (args->depth_thresholds == NULL)
+            error("Could not allocate --depth-thresholds.\n");
+        args->depth_thresholds[args->n_depth_thresholds++] = threshold;
+        p = *endptr ? endptr + 1 : endptr;
+    }
+}
 
 /*
  *     This short description is used to generate the output of `bcftools plugin -l`.
@@ -50,10 +273,33 @@ const char *usage(void)
            "\tCalculate per-sample summary metrics.\n"
            "\tDefault is to only include data where FT is 'PASS' or 'No_var'. --fail to use only failed data or --both to use both.\n"
            "\tDefault also assumes file is SNP only. You can give --indel to turn off ti/tv counts.\n" 
+           "\t--no-coverage leaves out the coverage columns and never reads DP.\n"
+           "\t--depth-stats adds the 10th, 50th and 90th percentile of each sample's DP, and the fraction of its DP\n"
+           "\t    values at or above each of --depth-thresholds LIST (default " DEPTH_THRESHOLDS "). Unlike the average,\n"
+           "\t    these include DP above 1000. Values from 128 up are rounded down to one of 4 steps per power of two.\n"
+           "\t--ibs FILE also counts, for every pair of samples, the sites where both are called and the sites where they\n"
+           "\t    share 0, 1 or 2 alleles identical by state, and writes them to FILE with the discordance rate.\n"
+           "\t    With --write-partial, the pair counts are saved in the partial and FILE is not written; give --ibs FILE\n"
+           "\t    again at the --merge to write it.\n"
+           "\t--threads N counts records on N worker threads.\n"
+           "\t--from-cache FILE counts the sites of a genotype cache made by HGSC_build_cache, without decoding the\n"
+           "\t    BCF it was made from. Give the BCF's header (e.g. from bcftools view -h) as the input.\n"
+           "\t--columnar FILE writes the table to FILE as typed columns (see HGSC_columnar.h) instead of printing it.\n"
+           "\t--stats prints where the time went to stderr at the end, with a progress line every 10 seconds.\n"
+           "\t    --stats-json FILE writes the same summary to FILE as JSON.\n"
+           "\t--write-partial FILE saves the counters to FILE instead of printing them, e.g. for one chromosome.\n"
+           "\t--merge adds the partials listed after the options to the counts, then prints (or saves) the result.\n"
+           "\t    The partials must be made with the same options and samples; use a header-only input to merge.\n"
            "bcftools +plugin_name GENERAL_OPTIONS INPUT.bcf -- PLUGINS_OPTIONS\n"
            "bcftools +HGSC_sample_summary INPUT.bcf\n"
            "bcftools +HGSC_sample_summary INPUT.bcf -- --fail\n"
-           "bcftools +HGSC_sample_summary INPUT.bcf -- --both --indel\n";
+           "bcftools +HGSC_sample_summary INPUT.bcf -- --both --indel\n"
+           "bcftools +HGSC_sample_summary INPUT.bcf -- --threads 16\n"
+           "bcftools +HGSC_sample_summary INPUT.bcf -- --depth-stats --depth-thresholds 1,10,20,30,50\n"
+           "bcftools +HGSC_sample_summary INPUT.bcf -- --ibs pairs.csv --threads 16\n"
+           "bcftools +HGSC_sample_summary HEADER_ONLY.vcf -- --both --from-cache INPUT.gtc\n"
+           "bcftools +HGSC_sample_summary -r chr1 INPUT.bcf -- --write-partial chr1.part\n"
+           "bcftools +HGSC_sample_summary HEADER_ONLY.vcf -- --merge chr*.part\n";
 }
 
 /*
@@ -62,143 +308,706 @@ const char *usage(void)
  *         */
 int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
 {
+    hgsc_stats_init(&stats, "HGSC_sample_summary", &argc, argv, in);
     nsamples = bcf_hdr_nsamples(in);
     header = in;
     args = calloc(1, sizeof(args_t));
     args->use_pass = true;
     args->use_fail = false;
     args->is_indel_file = false;
+    args->use_coverage = true;
+    args->nthreads = 0;
+    args->partial_fname = NULL;
+    args->depth_stats = false;
+    args->columnar_fname = NULL;
+    args->ibs_fname = NULL;
+    args->cache_fname = NULL;
+    bool merge = false;
+    char *depth_thresholds = DEPTH_THRESHOLDS;
 
     static struct option long_options[] =
     {
         {"help", no_argument, NULL, 'h'},
         {"fail", no_argument, NULL, 'f'},
         {"both", no_argument, NULL, 'b'},
-        {"indel", no_argument, NULL, 'i'}
+        {"indel", no_argument, NULL, 'i'},
+        {"no-coverage", no_argument, NULL, 'C'},
+        {"depth-stats", no_argument, NULL, 'd'},
+        {"depth-thresholds", required_argument, NULL, 'D'},
+        {"threads", required_argument, NULL, 't'},
+        {"write-partial", required_argument, NULL, 'w'},
+        {"merge", no_argument, NULL, 'm'},
+        {"columnar", required_argument, NULL, 'c'},
+        {"ibs", required_argument, NULL, 'I'},
+        {"from-cache", required_argument, NULL, 'F'},
+        {NULL, 0, NULL, 0}
     };
     int opt;
-    while ((opt = getopt_long(argc, argv, "hfbi", long_options, NULL)) >= 0)
+    char *endptr;
+    while ((opt = getopt_long(argc, argv, "hfbiCdD:t:w:mc:I:F:", long_options, NULL)) >= 0)
     {
         switch(opt)
         {
             case 'f': args->use_pass = false; args->use_fail = true; break;
             case 'b': args->use_fail = true; break;
             case 'i': args->is_indel_file = true; break;
+            case 'C': args->use_coverage = false; break;
+            case 'd': args->depth_stats = true; break;
+            case 'D': args->depth_stats = true; depth_thresholds = optarg; break;
+            case 't':
+                args->nthreads = strtol(optarg, &endptr, 10);
+                if (*endptr || args->nthreads < 1)
+                    error("Could not parse --threads %s\n", optarg);
+                break;
+            case 'w': args->partial_fname = optarg; break;
+            case 'm': merge = true; break;
+            case 'c': args->columnar_fname = optarg; break;
+            case 'I': args->ibs_fname = optarg; break;
+            case 'F': args->cache_fname = optarg; break;
             default: error("%s", usage()); break;
         }
     } 
+    if (merge == (optind == argc))  // --merge needs partials, and only --merge takes them
+        error("%s", usage());
+    if (args->columnar_fname != NULL && args->partial_fname != NULL)
+        error("--columnar and --write-partial can't be used together\n");
+    if (args->depth_stats && !args->use_coverage)
+        error("--depth-stats needs DP, so it can't be used with --no-coverage\n");
+    if (args->depth_stats)
+        parse_depth_thresholds(depth_thresholds);
 
     num_sites = 0;
     
-    samp_buckets = calloc(nsamples, sizeof(bucket_t *));
+    if (buckets_alloc(&samp_buckets, nsamples) != 0)
+        error("Could not allocate counters for %d samples.\n", nsamples);
+    if (args->ibs_fname != NULL && hgsc_ibs_init(&ibs, nsamples) != 0)
+        error("Could not allocate --ibs counters for %d samples.\n", nsamples);
+    if (args->ibs_fname != NULL && args->partial_fname == NULL && (ibs_fp = fopen(args->ibs_fname, "w")) == NULL)
+        error("Could not create %s\n", args->ibs_fname);
+
     int i;
-    for (i = 0; i < nsamples; i++)
+    for (i = optind; i < argc; i++)
+        merge_partial(argv[i]);
+
+    batch_size = 1;
+    if (args->nthreads > 0)
     {
-        samp_buckets[i] = calloc(nsamples, sizeof(bucket_t));
+        batch_size = RECORDS_PER_THREAD * args->nthreads;
+        thread_buckets = calloc(args->nthreads, sizeof(bucket_t));
+        for (i = 0; i < args->nthreads; i++)
+        {
+            if (buckets_alloc(&thread_buckets[i], nsamples) != 0)
+                error("Could not allocate counters for %d samples.\n", nsamples);
+        }
+
+        pool = hgsc_pool_init(args->nthreads);
+        if (pool == NULL)
+            error("Could not start %d threads.\n", args->nthreads);
     }
 
+    batches[0].records = calloc(batch_size, sizeof(record_t));
+    batches[1].records = calloc(batch_size, sizeof(record_t));
+    cur_batch = 0;
+    for (i = 0; i < batch_size; i++)
+    {
+        batches[0].records[i].decode.stats = &stats;
+        batches[1].records[i].decode.stats = &stats;
+    }
+    hgsc_stats_lap(&stats, HGSC_PHASE_SETUP);
+
+    if (args->cache_fname != NULL)
+        read_cache(args->cache_fname);
+
     return 1;
 }
 
 
+/*
+ *     Whether no sample is counted at the site whose FT codes r holds.
+ *     */
+bool skip_record(const record_t *r)
+{
+    unsigned int counted = (args->use_pass ? HGSC_FT_PASSING : 0) | (args->use_fail ? ~HGSC_FT_PASSING : 0);
+    return !hgsc_any_ft(&r->decode, nsamples, counted);
+}
+
+/*
+ *     Fill in the allele table of r, for ti/tv.
+ *     */
+void set_alleles(record_t *r, int n_allele, const char **alleles)
+{
+    if (r->m_allele < n_allele)
+    {
+        r->m_allele = n_allele;
+        r->allele_bases = realloc(r->allele_bases, r->m_allele * sizeof(int));
+        if (r->allele_bases == NULL)
+            error("Could not allocate allele table.\n");
+    }
+
+    int i;
+    r->n_allele = n_allele;
+    for (i = 0; i < r->n_allele; i++)
+        r->allele_bases[i] = bcf_acgt2int(*alleles[i]);
+}
+
+/*
+ *     Decode the FORMAT fields and alleles of rec into r.
+ *     */
+void decode_record(record_t *r, bcf1_t *rec)
+{
+    hgsc_decode_fields(&r->decode, header, rec, nsamples, HGSC_FIELD_FT);
+    r->skip = skip_record(r);
+    if (r->skip)
+        return;
+
+    // counted straight from the packed values; they only need copying if another thread counts them later
+    r->decoded = hgsc_decode_fields(&r->decode, header, rec, nsamples,
+                                    HGSC_FIELD_GT_VIEW | (args->use_coverage ? HGSC_FIELD_DP_VIEW : 0)
+                                    | (pool != NULL ? HGSC_FIELD_KEEP : 0));
+    set_alleles(r, rec->n_allele, (const char **) rec->d.allele);
+}
+
+/*
+ *     The same for site j of a genotype cache. The expanded fields are r's own copies.
+ *     */
+void decode_cached_record(record_t *r, hgsc_cache_t *cache, uint64_t j)
+{
+    hgsc_cache_decode(cache, j, &r->decode, HGSC_FIELD_FT);
+    r->skip = skip_record(r);
+    if (r->skip)
+        return;
+
+    r->decoded = hgsc_cache_decode(cache, j, &r->decode,
+                                   HGSC_FIELD_GT_VIEW | (args->use_coverage ? HGSC_FIELD_DP_VIEW : 0));
+    set_alleles(r, hgsc_cache_site(cache, j)->n_allele, hgsc_cache_alleles(cache, j));
+}
+
+
+/*
+ *     Whether genotypes with this FT class are counted under --fail/--both.
+ *     */
+static inline bool is_counted(bool is_pass)
+{
+    return is_pass ? args->use_pass : args->use_fail;
+}
+
+static inline bool is_passing(uint8_t ft_code)
+{
+    return ft_code == HGSC_FT_PASS || ft_code == HGSC_FT_NVAR;
+}
+
+/*
+ *     Add sample i's genotype at this site to its counters.
+ *     */
+static inline void count_genotype(bucket_t *buckets, const record_t *r, int i, bool is_pass, int all1, int all2)
+{
+    const int *allele_bases = r->allele_bases;
+    int ref_base_num = allele_bases[0];
+
+    if (all1 == 0 && all2 == 0)
+    {
+        buckets->ref[i]++;
+    }
+    else if (all1 != all2 && all1 >= 0 && all2 >= 0)
+    {
+        buckets->het[i]++;
+        
+        if (is_pass)
+            buckets->passing_variants[i]++;           
+ 
+        // stored as 0, 1, 2, 3 for A, C, G, T, respectively, so we can do this small madness
+        if (!args->is_indel_file)
+        {
+            int alt = all2 != 0 ? all2 : all1;  // a 1/0 has its ALT first
+            int alt_base_num = alt < r->n_allele ? allele_bases[alt] : -1;
+            if (abs(ref_base_num - alt_base_num) == 2)                  
+                buckets->transitions[i]++;
+            else
+                buckets->transversions[i]++;
+        }
+    }
+    else if (all1 == all2 && all1 >= 0 && all2 >= 0)
+    {
+        buckets->var[i]++;
+    
+        if (is_pass)
+            buckets->passing_variants[i]++;
+
+        if (!args->is_indel_file)
+        {        
+            int all1_base_num = all1 < r->n_allele ? allele_bases[all1] : -1;
+            if (abs(ref_base_num - all1_base_num) == 2)                  
+                buckets->transitions[i]++;
+            else
+                buckets->transversions[i]++;
+            
+            int all2_base_num = all2 < r->n_allele ? allele_bases[all2] : -1;
+            if (abs(ref_base_num - all2_base_num) == 2)                  
+                buckets->transitions[i]++;
+            else
+                buckets->transversions[i]++;
+        } 
+    }
+    else
+    {
+        buckets->missing[i]++;
+    }
+}
+
+// count_genotypes_<width>_<ploidy>: the genotype counters, reading GT at its packed width
+#define COUNT_GENOTYPES(suffix, gt_t, ploidy) \
+static void count_genotypes_##suffix(bucket_t *buckets, const record_t *r) \
+{ \
+    const uint8_t *ft_codes = r->decode.ft_codes; \
+    const hgsc_fmt_view_t *gt = &r->decode.gt_view; \
+    int i; \
+    for (i = 0; i < nsamples; i++) \
+    { \
+        bool is_pass = is_passing(ft_codes[i]); \
+        if (is_counted(is_pass)) \
+            count_genotype(buckets, r, i, is_pass, HGSC_GT_ALLELE_P(gt_t, gt, ploidy, i, 0), \
+                           HGSC_GT_ALLELE_P(gt_t, gt, ploidy, i, 1)); \
+    } \
+}
+HGSC_FOR_EACH_WIDTH_PLOIDY(COUNT_GENOTYPES)
+
+/*
+ *     --ibs class of a genotype, split the same way as the homref/hetvar/homvar/missing counters.
+ *     */
+static inline int ibs_class(int all1, int all2)
+{
+    if (all1 == 0 && all2 == 0)
+        return HGSC_IBS_HOMREF;
+    if (all1 < 0 || all2 < 0)
+        return HGSC_IBS_MISSING;
+    return all1 != all2 ? HGSC_IBS_HET : HGSC_IBS_HOMVAR;
+}
+
+// pack_ibs_<width>_<ploidy>: the class of every counted genotype into the --ibs bit planes; the rest stay missing
+#define PACK_IBS(suffix, gt_t, ploidy) \
+static void pack_ibs_##suffix(const record_t *r) \
+{ \
+    const uint8_t *ft_codes = r->decode.ft_codes; \
+    const hgsc_fmt_view_t *gt = &r->decode.gt_view; \
+    int i; \
+    for (i = 0; i < nsamples; i++) \
+    { \
+        if (is_counted(is_passing(ft_codes[i]))) \
+            hgsc_ibs_set(&ibs, i, ibs_class(HGSC_GT_ALLELE_P(gt_t, gt, ploidy, i, 0), \
+                                            HGSC_GT_ALLELE_P(gt_t, gt, ploidy, i, 1))); \
+    } \
+}
+HGSC_FOR_EACH_WIDTH_PLOIDY(PACK_IBS)
+
+/*
+ *     Histogram bin of a DP value: the value itself below DEPTH_EXACT_BINS, then DEPTH_STEPS bins per power of two.
+ *     */
+static inline int depth_bin(int depth)
+{
+    if (depth < DEPTH_EXACT_BINS)
+        return depth;
+    int octave = 31 - __builtin_clz(depth);  // at least DEPTH_EXACT_BITS
+    return DEPTH_EXACT_BINS + (octave - DEPTH_EXACT_BITS) * DEPTH_STEPS
+           + ((depth >> (octave - DEPTH_STEP_BITS)) & (DEPTH_STEPS - 1));
+}
+
+/*
+ *     Smallest DP that falls in bin.
+ *     */
+static inline int depth_bin_start(int bin)
+{
+    if (bin < DEPTH_EXACT_BINS)
+        return bin;
+    int octave = DEPTH_EXACT_BITS + (bin - DEPTH_EXACT_BINS) / DEPTH_STEPS;
+    int step = (bin - DEPTH_EXACT_BINS) % DEPTH_STEPS;
+    return (DEPTH_STEPS + step) << (octave - DEPTH_STEP_BITS);
+}
+
+// count_coverage_int8/_int16/_int32: the coverage counters, reading DP at its packed width
+#define COUNT_COVERAGE(width, dp_t) \
+static void count_coverage_##width(bucket_t *buckets, const record_t *r) \
+{ \
+    const uint8_t *ft_codes = r->decode.ft_codes; \
+    const hgsc_fmt_view_t *dp = &r->decode.depth_view; \
+    int *depth_hist = buckets->depth_hist; \
+    int i; \
+    for (i = 0; i < nsamples; i++) \
+    { \
+        int depth = HGSC_VIEW_VALUE(dp_t, dp, i, 0); \
+        /* missing values are negative at every width, so skip */ \
+        if (!is_counted(is_passing(ft_codes[i])) || depth < 0) \
+            continue; \
+        if (depth >= MIN_COVERAGE && depth <= MAX_COVERAGE) \
+        { \
+            buckets->total_coverage[i] += depth; \
+            buckets->genotypes_with_depth[i]++; \
+        } \
+        if (depth_hist != NULL) \
+            depth_hist[(size_t) i * DEPTH_BINS + depth_bin(depth)]++; \
+    } \
+}
+HGSC_FOR_EACH_WIDTH(COUNT_COVERAGE)
+
+/*
+ *     Add one decoded record to the per-sample counters in buckets.
+ *     */
+void count_record(bucket_t *buckets, const record_t *r)
+{
+    if (r->skip)
+        return;
+
+    if (r->decoded & HGSC_FIELD_DP_VIEW)
+        HGSC_VIEW_DISPATCH(&r->decode.depth_view, count_coverage, buckets, r);
+
+    if (r->decoded & HGSC_FIELD_GT_VIEW)
+        HGSC_GT_DISPATCH(&r->decode.gt_view, count_genotypes, buckets, r);
+}
+
+
+/*
+ *     Pool job: worker `thread` counts its share of the batch into its own counters.
+ *     */
+void count_batch(void *arg, int thread, int nthreads)
+{
+    batch_t *batch = arg;
+    int start, end, i;
+    hgsc_pool_range(batch->n, thread, nthreads, &start, &end);
+    for (i = start; i < end; i++)
+        count_record(&thread_buckets[thread], &batch->records[i]);
+}
+
+
+/*
+ *     Count the --ibs block being filled, on the workers with --threads, and start filling the other one.
+ *     */
+void dispatch_ibs_block(void)
+{
+    if (pool != NULL)
+        hgsc_pool_start(pool, hgsc_ibs_count_block, &ibs.blocks[ibs.cur]);  // waits for the previous job first
+    else
+        hgsc_ibs_count_block(&ibs.blocks[ibs.cur], 0, 1);
+    hgsc_ibs_swap(&ibs);
+}
+
+
+/*
+ *     Hand the current batch to the workers and start filling the other one.
+ *     */
+void dispatch_batch(void)
+{
+    hgsc_pool_start(pool, count_batch, &batches[cur_batch]);  // waits for the other batch to be done first
+    cur_batch ^= 1;
+    batches[cur_batch].n = 0;
+}
+
+
+/*
+ *     The slot for the next site in the batch being filled.
+ *     */
+record_t *next_record(void)
+{
+    num_sites++;
+    batch_t *batch = &batches[cur_batch];
+    return &batch->records[batch->n++];
+}
+
+/*
+ *     Count the site just decoded into r, the last slot of the batch being filled, or hand the batch to the workers
+ *     once it is full.
+ *     */
+void record_ready(record_t *r)
+{
+    // packed here rather than on the workers, while the GT view still points into rec
+    if (args->ibs_fname != NULL && !r->skip && (r->decoded & HGSC_FIELD_GT_VIEW))
+    {
+        HGSC_GT_DISPATCH(&r->decode.gt_view, pack_ibs, r);
+        if (hgsc_ibs_next_site(&ibs))
+            dispatch_ibs_block();
+    }
+
+    if (pool == NULL)
+    {
+        count_record(&samp_buckets, r);
+        batches[cur_batch].n = 0;
+    }
+    else if (batches[cur_batch].n == batch_size)
+    {
+        dispatch_batch();
+    }
+    hgsc_stats_lap(&stats, HGSC_PHASE_COUNT);
+}
+
+
+/*
+ *     Count every site of the --from-cache file, as if its records came before the input's.
+ *     */
+void read_cache(const char *fname)
+{
+    hgsc_cache_t cache;
+    hgsc_cache_open(&cache, fname, header);
+
+    uint64_t j;
+    for (j = 0; j < cache.nsites; j++)
+    {
+        hgsc_stats_record(&stats, cache.rids[cache.sites[j].rid], cache.sites[j].pos);
+        record_t *r = next_record();
+        decode_cached_record(r, &cache, j);
+        record_ready(r);
+    }
+
+    hgsc_cache_close(&cache);
+}
+
+
 /*
  *     Called for each VCF record. Return rec to output the line or NULL
  *         to suppress output.
  *         */
 bcf1_t *process(bcf1_t *rec)
 {
-    int bcf_get_success_check;
+    hgsc_stats_lap(&stats, HGSC_PHASE_BCFTOOLS);
+    hgsc_stats_record(&stats, rec->rid, rec->pos);
+    record_t *r = next_record();
+    decode_record(r, rec);
+    record_ready(r);
+    return NULL;
+}
 
-    num_sites++;
 
-    char **filter_data = NULL;
-    int32_t num_filter_data = 0;
-    bcf_get_success_check = bcf_get_format_string(header, rec, "FT", &filter_data, &num_filter_data);
-    
-    int32_t *gt_data = NULL;
-    int32_t num_gt_data = 0;
-    bcf_get_success_check = bcf_get_genotypes(header, rec, &gt_data, &num_gt_data);
+/*
+ *     Smallest DP with at least percent% of the sample's DP values at or below it, from its histogram of total values.
+ *     */
+int depth_percentile(const int *hist, long total, int percent)
+{
+    long rank = (percent * total + 99) / 100;  // nearest rank
+    long seen = 0;
+    int bin;
+    for (bin = 0; bin < DEPTH_BINS; bin++)
+    {
+        seen += hist[bin];
+        if (seen >= rank && seen > 0)
+            break;
+    }
+    return depth_bin_start(bin);
+}
+
+/*
+ *     Add a column to the output, see print_summary().
+ *     */
+void add_column(const char *name, int type)
+{
+    columns = realloc(columns, (ncolumns + 1) * sizeof(*columns));
+    column_types = realloc(column_types, (ncolumns + 1) * sizeof(int));
+    if (columns == NULL || column_types == NULL || (columns[ncolumns] = strdup(name)) == NULL)
+        error("Could not allocate the column names.\n");
+    column_types[ncolumns++] = type;
+}
+
+// One value of the row being output: the next CSV field, or the next --columnar column.
+void put_string(const char *value)
+{
+    if (args->columnar_fname != NULL)
+        hgsc_columnar_put_string(&columnar, value);
+    else
+        hgsc_stats_output(&stats, printf("%s%s", row_column ? "," : "", value));
+    row_column++;
+}
 
-    int32_t *depth_data = NULL;
-    int32_t num_depth_data = 0;
-    bcf_get_success_check = bcf_get_format_int32(header, rec, "DP", &depth_data, &num_depth_data);
+void put_int(int value)
+{
+    if (args->columnar_fname != NULL)
+        hgsc_columnar_put_int32(&columnar, value);
+    else
+        hgsc_stats_output(&stats, printf("%s%d", row_column ? "," : "", value));
+    row_column++;
+}
 
-    int ref_base_num = bcf_acgt2int(*rec->d.allele[0]);
+void put_long(long value)
+{
+    if (args->columnar_fname != NULL)
+        hgsc_columnar_put_int64(&columnar, value);
+    else
+        hgsc_stats_output(&stats, printf("%s%ld", row_column ? "," : "", value));
+    row_column++;
+}
 
-    int i;
-    for (i = 0; i < nsamples; i++)
-    {
-        int all1 = bcf_gt_allele(gt_data[2*i + 0]);
-        int all2 = bcf_gt_allele(gt_data[2*i + 1]);
-        bool is_pass = (strcmp(filter_data[i], "PASS") == 0) || (strcmp(filter_data[i], "No_var") == 0);
+void put_double(double value)
+{
+    if (args->columnar_fname != NULL)
+        hgsc_columnar_put_float64(&columnar, value);
+    else
+        hgsc_stats_output(&stats, printf("%s%lf", row_column ? ",": "", value));
+    row_column++;
+}
 
-        if (is_pass && !args->use_pass)
-            continue;
+// A depth percentile, or -1 for none: printed as an integer, but a float64 column so "none" can be NaN
+void put_depth(int depth)
+{
+    if (args->columnar_fname != NULL)
+        hgsc_columnar_put_float64(&columnar, depth < 0 ? NAN : depth);
+    else if (depth < 0)
+        hgsc_stats_output(&stats, printf("%snan", row_column ? "," : ""));
+    else
+        hgsc_stats_output(&stats, printf("%s%d", row_column ? "," : "", depth));
+    row_column++;
+}
 
-        if (!is_pass && !args->use_fail)
-            continue;
+void end_row(void)
+{
+    if (args->columnar_fname != NULL)
+        hgsc_columnar_end_row(&columnar);
+    else
+        hgsc_stats_output(&stats, printf("\n"));
+    row_column = 0;
+}
+
+/*
+ *     Output the --depth-stats columns of one sample from its DP histogram.
+ *     */
+void put_depth_stats(const int *hist)
+{
+    long total = 0;
+    int bin, j;
+    for (bin = 0; bin < DEPTH_BINS; bin++)
+        total += hist[bin];
 
-        if (depth_data[i] >= MIN_COVERAGE && depth_data[i] <= MAX_COVERAGE) //errors are a big negative number, so skip
+    put_depth(total == 0 ? -1 : depth_percentile(hist, total, 10));
+    put_depth(total == 0 ? -1 : depth_percentile(hist, total, 50));
+    put_depth(total == 0 ? -1 : depth_percentile(hist, total, 90));
+
+    for (j = 0; j < args->n_depth_thresholds; j++)
+    {
+        long above = 0;
+        for (bin = depth_bin(args->depth_thresholds[j]); bin < DEPTH_BINS; bin++)
+            above += hist[bin];
+        put_double(total == 0 ? NAN : above / (double) total);  // 0.0 / 0 would print as -nan
+    }
+}
+
+/*
+ *     Output the per-sample table: as CSV on stdout, or to the --columnar file.
+ *     */
+void print_summary(void)
+{
+    int i;
+    add_column("sample", HGSC_COL_STRING);
+    add_column("variant_count", HGSC_COL_INT32);
+    add_column("passing_variant_count", HGSC_COL_INT32);
+    add_column("ti_tv_ratio", HGSC_COL_FLOAT64);
+    add_column("homref", HGSC_COL_INT32);
+    add_column("hetvar", HGSC_COL_INT32);
+    add_column("homvar", HGSC_COL_INT32);
+    add_column("missing", HGSC_COL_INT32);
+    add_column("het_hom_ratio", HGSC_COL_FLOAT64);
+    add_column("missing_rate", HGSC_COL_FLOAT64);
+    if (args->use_coverage)
+    {
+        add_column("average_coverage", HGSC_COL_FLOAT64);
+        add_column("coverage_numerator", HGSC_COL_INT64);
+        add_column("coverage_denominator", HGSC_COL_INT32);
+    }
+    if (args->depth_stats)
+    {
+        add_column("depth_p10", HGSC_COL_FLOAT64);
+        add_column("depth_median", HGSC_COL_FLOAT64);
+        add_column("depth_p90", HGSC_COL_FLOAT64);
+        for (i = 0; i < args->n_depth_thresholds; i++)
         {
-            samp_buckets[i]->total_coverage += depth_data[i];
-            samp_buckets[i]->genotypes_with_depth++;
-        } 
+            char name[64];
+            snprintf(name, sizeof(name), "frac_depth_ge_%d", args->depth_thresholds[i]);
+            add_column(name, HGSC_COL_FLOAT64);
+        }
+    }
+
+    if (args->columnar_fname != NULL)
+    {
+        hgsc_columnar_create(&columnar, args->columnar_fname, ncolumns, (const char **) columns, column_types);
+    }
+    else
+    {
+        for (i = 0; i < ncolumns; i++)
+            put_string(columns[i]);
+        end_row();
+    }
 
-        if (all1 == 0 && all2 == 0)
+    for (i = 0; i < nsamples; i++)
+    {
+        put_string(header->samples[i]);
+        put_int(samp_buckets.het[i] + samp_buckets.var[i]);
+        put_int(samp_buckets.passing_variants[i]);
+        put_double(samp_buckets.transitions[i] / (double) samp_buckets.transversions[i]);
+        put_int(samp_buckets.ref[i]);
+        put_int(samp_buckets.het[i]);
+        put_int(samp_buckets.var[i]);
+        put_int(samp_buckets.missing[i]);
+        put_double(samp_buckets.het[i] / (double) samp_buckets.var[i]);
+        put_double(samp_buckets.missing[i] / (double) num_sites);
+        if (args->use_coverage)
         {
-            samp_buckets[i]->ref++;
+            put_double(samp_buckets.total_coverage[i] / (double) samp_buckets.genotypes_with_depth[i]);
+            put_long(samp_buckets.total_coverage[i]);
+            put_int(samp_buckets.genotypes_with_depth[i]);
         }
-        else if (all1 != all2 && all1 >= 0 && all2 >= 0)
+        if (args->depth_stats)
+            put_depth_stats(samp_buckets.depth_hist + (size_t) i * DEPTH_BINS);
+        end_row();
+    }
+
+    if (args->columnar_fname != NULL)
+        hgsc_columnar_close(&columnar);
+    for (i = 0; i < ncolumns; i++)
+        free(columns[i]);
+    free(columns);
+    free(column_types);
+}
+
+/*
+ *     Write the --ibs counts, one row per pair of samples.
+ *     */
+void write_ibs(FILE *fp, const char *fname)
+{
+    kstring_t out = {0, 0, NULL};
+    kputs("sample1,sample2,called,ibs0,ibs1,ibs2,discordance\n", &out);
+
+    const uint32_t *counts = ibs.counts;
+    int a, b;
+    for (a = 0; a < nsamples; a++)
+    {
+        for (b = a + 1; b < nsamples; b++, counts += HGSC_IBS_NCOUNTS)
         {
-            samp_buckets[i]->het++;
-            
-            if (is_pass)
-                samp_buckets[i]->passing_variants++;           
- 
-            // stored as 0, 1, 2, 3 for A, C, G, T, respectively, so we can do this small madness
-            if (!args->is_indel_file)
+            uint32_t called = counts[HGSC_IBS_CALLED], ibs0 = counts[HGSC_IBS_IBS0], ibs2 = counts[HGSC_IBS_IBS2];
+            kputs(header->samples[a], &out);
+            kputc(',', &out);
+            kputs(header->samples[b], &out);
+            kputc(',', &out);
+            kputuw(called, &out);
+            kputc(',', &out);
+            kputuw(ibs0, &out);
+            kputc(',', &out);
+            kputuw(called - ibs0 - ibs2, &out);
+            kputc(',', &out);
+            kputuw(ibs2, &out);
+            kputc(',', &out);
+            if (called > 0)
+                hgsc_kput_ratio6(called - ibs2, called, &out);
+            else
+                kputs("nan", &out);
+            kputc('\n', &out);
+
+            if (out.l >= 65536)
             {
-                int all2_base_num = bcf_acgt2int(*rec->d.allele[all2]);
-                if (abs(ref_base_num - all2_base_num) == 2)                  
-                    samp_buckets[i]->transitions++;
-                else
-                    samp_buckets[i]->transversions++;
+                if (fwrite(out.s, 1, out.l, fp) != out.l)
+                    error("Could not write to %s\n", fname);
+                hgsc_stats_output(&stats, out.l);
+                out.l = 0;
             }
         }
-        else if (all1 == all2 && all1 >= 0 && all2 >= 0)
-        {
-            samp_buckets[i]->var++;
-    
-            if (is_pass)
-                samp_buckets[i]->passing_variants++;
-
-            if (!args->is_indel_file)
-            {        
-                int all1_base_num = bcf_acgt2int(*rec->d.allele[all1]);
-                if (abs(ref_base_num - all1_base_num) == 2)                  
-                    samp_buckets[i]->transitions++;
-                else
-                    samp_buckets[i]->transversions++;
-                
-                int all2_base_num = bcf_acgt2int(*rec->d.allele[all2]);
-                if (abs(ref_base_num - all2_base_num) == 2)                  
-                    samp_buckets[i]->transitions++;
-                else
-                    samp_buckets[i]->transversions++;
-            } 
-        }
-        else
-        {
-            samp_buckets[i]->missing++;
-        }
     }
 
-    free(gt_data);
-    free(depth_data);
-    free(filter_data[0]);
-    free(filter_data);
-
-    return NULL;
+    if (fwrite(out.s, 1, out.l, fp) != out.l || fclose(fp) != 0)
+        error("Could not write to %s\n", fname);
+    hgsc_stats_output(&stats, out.l);
+    free(out.s);
 }
 
 
@@ -207,32 +1016,55 @@ bcf1_t *process(bcf1_t *rec)
  *     */
 void destroy(void)
 {
-    printf("sample,variant_count,passing_variant_count,ti_tv_ratio,homref,hetvar,homvar,missing,het_hom_ratio,"
-           "missing_rate,average_coverage,coverage_numerator,coverage_denominator\n");
-
     int i;
-    for (i = 0; i < nsamples; i++)
+    hgsc_stats_lap(&stats, HGSC_PHASE_BCFTOOLS);
+    if (args->ibs_fname != NULL)
+        dispatch_ibs_block();
+
+    if (pool != NULL)
+    {
+        if (batches[cur_batch].n > 0)
+            dispatch_batch();
+        hgsc_pool_wait(pool);
+
+        // merge in worker order; the counters are integers so the result doesn't depend on scheduling
+        for (i = 0; i < args->nthreads; i++)
+        {
+            buckets_add(&samp_buckets, &thread_buckets[i], nsamples);
+            buckets_free(&thread_buckets[i]);
+        }
+        free(thread_buckets);
+        hgsc_pool_destroy(pool);
+    }
+    hgsc_stats_lap(&stats, HGSC_PHASE_COUNT);
+
+    if (args->partial_fname != NULL)
     {
-        printf("%s,", header->samples[i]);
-        printf("%d,", samp_buckets[i]->het + samp_buckets[i]->var);
-        printf("%d,", samp_buckets[i]->passing_variants);
-        printf("%lf,", samp_buckets[i]->transitions / (double) samp_buckets[i]->transversions);
-        printf("%d,", samp_buckets[i]->ref);
-        printf("%d,", samp_buckets[i]->het);
-        printf("%d,", samp_buckets[i]->var);
-        printf("%d,", samp_buckets[i]->missing);
-        printf("%lf,", samp_buckets[i]->het / (double) samp_buckets[i]->var);
-        printf("%lf,", samp_buckets[i]->missing / (double) num_sites);
-        printf("%lf,", samp_buckets[i]->total_coverage / (double) samp_buckets[i]->genotypes_with_depth);
-        printf("%ld,", samp_buckets[i]->total_coverage);
-        printf("%d", samp_buckets[i]->genotypes_with_depth);
-        printf("\n");
+        write_partial(args->partial_fname);
     }
+    else
+    {
+        print_summary();
+        if (args->ibs_fname != NULL)
+            write_ibs(ibs_fp, args->ibs_fname);
+    }
+    hgsc_stats_lap(&stats, HGSC_PHASE_OUTPUT);
 
-    for (i = 0; i < nsamples; i++)
-        free(samp_buckets[i]);
-    free(samp_buckets);
+    buckets_free(&samp_buckets);
+    if (args->ibs_fname != NULL)
+        hgsc_ibs_destroy(&ibs);
+    for (i = 0; i < batch_size; i++)
+    {
+        hgsc_decode_destroy(&batches[0].records[i].decode);
+        hgsc_decode_destroy(&batches[1].records[i].decode);
+        free(batches[0].records[i].allele_bases);
+        free(batches[1].records[i].allele_bases);
+    }
+    free(batches[0].records);
+    free(batches[1].records);
 
+    free(args->depth_thresholds);
     free(args);
+    hgsc_stats_report(&stats);
 }
 
@@ -0,0 +1,236 @@
+/*
+ *     Built-in instrumentation for the HGSC plugins, turned on with --stats or --stats-json FILE. The run is split into
+ *     phases by hgsc_stats_lap(), which charges all the time since the previous lap to one phase. The phases add up
+ *     to the wall time, and the clock is only read once per phase boundary. With both options off every call is a
+ *     test of one flag.
+ *
+ *     The phases are charged on the thread that calls process(). With --threads, count is the time spent handing
+ *     batches to the workers and waiting for them.
+ *     */
+#ifndef HGSC_STATS_H
+#define HGSC_STATS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include <htslib/vcf.h>
+#include "bcftools.h"
+
+#define HGSC_PHASE_BCFTOOLS 0  // between process() calls: bcftools reading, decompressing and writing records
+#define HGSC_PHASE_FT 1  // decoding and classifying FT
+#define HGSC_PHASE_GT 2  // decoding GT, or viewing it at its packed width
+#define HGSC_PHASE_DP 3  // likewise DP
+#define HGSC_PHASE_COUNT 4  // the plugin's own loops over the genotypes
+#define HGSC_PHASE_UPDATE 5  // re-encoding the record with bcf_update_*()
+#define HGSC_PHASE_OUTPUT 6  // formatting and writing the plugin's own output
+#define HGSC_PHASE_SETUP 7  // the rest of init() and destroy()
+#define HGSC_PHASE_NUM 8
+#define HGSC_STATS_PROGRESS_NS 10000000000ULL  // a progress line every 10 seconds
+
+static const char *hgsc_phase_names[HGSC_PHASE_NUM] = {"bcftools", "ft", "gt", "dp", "count", "update", "output",
+                                                       "setup"};
+
+typedef struct
+{
+    int on;  // --stats or --stats-json was given
+    const char *plugin;
+    int print;  // --stats: print the summary to stderr
+    const char *json_fname;  // --stats-json: write the summary here
+    FILE *json_fp;
+    const bcf_hdr_t *hdr;
+    uint64_t start;  // clock when the plugin started
+    uint64_t last;  // clock at the last lap
+    uint64_t next_progress;  // clock when the next progress line is due
+    uint64_t ns[HGSC_PHASE_NUM];
+    uint64_t records;
+    uint64_t bytes_out;
+    uint64_t *contig_starts;  // sum of the lengths of the contigs before each one, NULL if the header lacks any length
+    uint64_t genome_length;
+} hgsc_stats_t;
+
+static inline uint64_t hgsc_stats_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ *     Charge the time since the last lap to phase. st may be NULL.
+ *     */
+static inline void hgsc_stats_lap(hgsc_stats_t *st, int phase)
+{
+    if (st == NULL || !st->on)
+        return;
+    uint64_t now = hgsc_stats_clock();
+    st->ns[phase] += now - st->last;
+    st->last = now;
+}
+
+/*
+ *     Count len bytes of the plugin's own output. A negative len, e.g. from a printf() that failed, is left out.
+ *     */
+static inline void hgsc_stats_output(hgsc_stats_t *st, long len)
+{
+    if (len > 0)
+        st->bytes_out += len;
+}
+
+/*
+ *     Take --stats and --stats-json FILE out of argv so the plugin's own option parsing never sees them, and start
+ *     the clock if either was given.
+ *     */
+static inline void hgsc_stats_init(hgsc_stats_t *st, const char *plugin, int *argc, char **argv, const bcf_hdr_t *hdr)
+{
+    memset(st, 0, sizeof(*st));
+    st->plugin = plugin;
+    st->hdr = hdr;
+
+    int i, n = *argc > 0 ? 1 : 0;  // argv[0] is the plugin name
+    for (i = n; i < *argc; i++)
+    {
+        if (strcmp(argv[i], "--stats") == 0)
+            st->print = 1;
+        else if (strcmp(argv[i], "--stats-json") == 0 && i + 1 < *argc)
+            st->json_fname = argv[++i];
+        else if (strncmp(argv[i], "--stats-json=", 13) == 0)
+            st->json_fname = argv[i] + 13;
+        else
+            argv[n++] = argv[i];
+    }
+    *argc = n;
+
+    st->on = st->print || st->json_fname != NULL;
+    if (!st->on)
+        return;
+
+    // opened up front so a bad path fails before the whole input is read
+    if (st->json_fname != NULL && (st->json_fp = fopen(st->json_fname, "w")) == NULL)
+        error("Could not create %s\n", st->json_fname);
+
+    int ncontigs = hdr->n[BCF_DT_CTG];
+    st->contig_starts = malloc((ncontigs + 1) * sizeof(uint64_t));
+    for (i = 0; i < ncontigs && st->contig_starts != NULL; i++)
+    {
+        uint64_t len = hdr->id[BCF_DT_CTG][i].val->info[0];  // ##contig length, 0 if not given
+        if (len == 0)
+        {
+            free(st->contig_starts);
+            st->contig_starts = NULL;
+            break;
+        }
+        st->contig_starts[i] = st->genome_length;
+        st->genome_length += len;
+    }
+
+    st->start = st->last = hgsc_stats_clock();
+    st->next_progress = st->start + HGSC_STATS_PROGRESS_NS;
+}
+
+/*
+ *     Print where the run is, its speed so far and, if the header gives the contig lengths, an estimate of the time
+ *     left. The estimate assumes the whole file is read in the order of the header's contigs.
+ *     */
+static inline void hgsc_stats_progress(hgsc_stats_t *st, int rid, int64_t pos)
+{
+    double elapsed = (st->last - st->start) / 1e9;
+    fprintf(stderr, "%s: %llu records in %.0f s, %.0f records/s", st->plugin, (unsigned long long) st->records,
+            elapsed, st->records / elapsed);
+    if (rid >= 0 && rid < st->hdr->n[BCF_DT_CTG])
+    {
+        fprintf(stderr, ", at %s:%lld", bcf_hdr_id2name(st->hdr, rid), (long long) pos + 1);
+        double done = st->contig_starts != NULL ? (st->contig_starts[rid] + pos) / (double) st->genome_length : 0;
+        if (done > 0 && done < 1)
+        {
+            long left = elapsed * (1 - done) / done;
+            fprintf(stderr, ", %.1f%% done, ETA %ld:%02ld:%02ld", 100 * done, left / 3600, left / 60 % 60, left % 60);
+        }
+    }
+    fprintf(stderr, "\n");
+    st->next_progress = st->last + HGSC_STATS_PROGRESS_NS;
+}
+
+/*
+ *     Count one record, at 0-based pos of contig rid, and print a progress line if one is due. Call it after a lap,
+ *     so the clock doesn't need reading again.
+ *     */
+static inline void hgsc_stats_record(hgsc_stats_t *st, int rid, int64_t pos)
+{
+    if (!st->on)
+        return;
+    st->records++;
+    if (st->last >= st->next_progress)
+        hgsc_stats_progress(st, rid, pos);
+}
+
+/*
+ *     Print the summary to stderr with --stats, and write it to the --stats-json file. The time since the last lap
+ *     is charged to setup.
+ *     */
+static inline void hgsc_stats_report(hgsc_stats_t *st)
+{
+    if (!st->on)
+        return;
+    hgsc_stats_lap(st, HGSC_PHASE_SETUP);
+
+    double wall = (st->last - st->start) / 1e9;
+    uint64_t genotypes = st->records * bcf_hdr_nsamples(st->hdr);
+    double records_per_s = wall > 0 ? st->records / wall : 0;
+    double genotypes_per_s = wall > 0 ? genotypes / wall : 0;
+
+    struct rusage usage;
+    double peak_rss_mb = getrusage(RUSAGE_SELF, &usage) == 0 ? usage.ru_maxrss / 1024.0 : -1;  // ru_maxrss is in kB
+    double heap_mb = -1;
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 info = mallinfo2();
+    heap_mb = (info.uordblks + info.hblkhd) / 1048576.0;  // in use from the heap and from mmap
+#endif
+
+    int i;
+    if (st->print)
+    {
+        fprintf(stderr, "%s: %llu records, %llu genotypes and %llu bytes of output in %.3f s\n", st->plugin,
+                (unsigned long long) st->records, (unsigned long long) genotypes,
+                (unsigned long long) st->bytes_out, wall);
+        fprintf(stderr, "%s: %.0f records/s, %.0f genotypes/s, peak RSS %.1f MB", st->plugin, records_per_s,
+                genotypes_per_s, peak_rss_mb);
+        if (heap_mb >= 0)
+            fprintf(stderr, ", %.1f MB allocated at the end", heap_mb);
+        fprintf(stderr, "\n");
+        for (i = 0; i < HGSC_PHASE_NUM; i++)
+        {
+            fprintf(stderr, "%s: %-8s %10.3f s %5.1f%%\n", st->plugin, hgsc_phase_names[i], st->ns[i] / 1e9,
+                    wall > 0 ? 100 * st->ns[i] / 1e9 / wall : 0);
+        }
+    }
+
+    if (st->json_fp != NULL)
+    {
+        FILE *fp = st->json_fp;
+        fprintf(fp, "{\n  \"plugin\": \"%s\",\n  \"wall_s\": %.6f,\n", st->plugin, wall);
+        fprintf(fp, "  \"records\": %llu,\n  \"genotypes\": %llu,\n  \"bytes_out\": %llu,\n",
+                (unsigned long long) st->records, (unsigned long long) genotypes, (unsigned long long) st->bytes_out);
+        fprintf(fp, "  \"records_per_s\": %.1f,\n  \"genotypes_per_s\": %.1f,\n", records_per_s, genotypes_per_s);
+        fprintf(fp, "  \"peak_rss_mb\": %.1f,\n", peak_rss_mb);
+        if (heap_mb >= 0)
+            fprintf(fp, "  \"allocated_mb\": %.1f,\n", heap_mb);
+        fprintf(fp, "  \"phases_s\": {");
+        for (i = 0; i < HGSC_PHASE_NUM; i++)
+            fprintf(fp, "%s\n    \"%s\": %.6f", i ? "," : "", hgsc_phase_names[i], st->ns[i] / 1e9);
+        fprintf(fp, "\n  }\n}\n");
+        if (fclose(fp) != 0)
+            error("Could not write to %s\n", st->json_fname);
+        st->json_fp = NULL;
+    }
+
+    free(st->contig_starts);
+    st->contig_starts = NULL;
+}
+
+#endif
@@ -1,23 +1,98 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <getopt.h>
 #include <htslib/vcf.h>
 #include <htslib/vcfutils.h>
+#include <htslib/kstring.h>
+#include "bcftools.h"
+#include "HGSC_common.h"
+#include "HGSC_pool.h"
+#include "HGSC_partial.h"
+#include "HGSC_columnar.h"
+#include "HGSC_cache.h"
 
-#define MAX_ALLELES 256 // I can't fathom there being more than this
+#define RECORDS_PER_THREAD 32  // records handed to each worker per batch with --threads
+#define FORMAT_FIELDS (HGSC_FIELD_FT | HGSC_FIELD_GT_VIEW)  // no DP; GT is counted at its packed width
+#define ROW_BLOCK 65536  // rows are written out in blocks of about this many bytes
+#define PARTIAL_MAGIC "HGSCvs\x00\x02"  // HGSC_partial.h file written by this plugin, format version 2
+#define NO_GT_ROW "Error getting gt"  // what a site without GT prints instead of a row (with no newline)
+#define NUM_ROW_COLUMNS 11
+
+typedef struct
+{
+    int pass_het;  // Number of genotypes, use this + hom to calculate # of variants GTs
+    int pass_hom;
+    int pass_ref;
+    int missing;
+    int fail_het;  // Number of genotypes, use this + hom to calculate # of variants GTs
+    int fail_hom;
+    int fail_ref;
+    int monomorphic;
+} totals_t;
+
+// One site: decoded by process(), counted by count_record(), printed by print_record().
+typedef struct
+{
+    hgsc_decode_t decode;
+    int rid;
+    int pos;
+    bool has_gt;  // false if GT couldn't be read; the site is reported and skipped
+    int var_het_pass;
+    int var_hom_pass;
+    int var_ref_pass;
+    int var_het_fail;
+    int var_hom_fail;
+    int var_ref_fail;
+    int var_miss;
+    int n_allele;  // REF + ALTs; GT alleles outside 0 .. n_allele - 1 count as missing
+    int allele0_count;  // number of '0' alleles
+    int allele1_count;  // number of '1' alleles
+    int total_alleles_observed;
+    bool is_monomorphic;  // all non-'.' alleles are '1'
+} record_t;
+
+typedef struct
+{
+    record_t *records;
+    int n;
+} batch_t;
+
+// One output row, as print_record() makes it from a site and merge_partial() reads it back from a partial.
+typedef struct
+{
+    const char *chr;  // NULL for a site whose GT couldn't be read
+    int32_t pos;  // 1-based
+    int32_t counts[7];  // pass_homref through missing, in column order
+    int32_t allele1_count;  // minor_allele_freq is allele1_count / total_alleles_observed
+    int32_t total_alleles_observed;
+    int32_t is_monomorphic;
+} row_t;
 
 int nsamples;
 int total_sites;
-int pass_het;  // Number of genotypes, use this + hom to calculate # of variants GTs
-int pass_hom;
-int pass_ref;
-int missing;
-int fail_het;  // Number of genotypes, use this + hom to calculate # of variants GTs
-int fail_hom;
-int fail_ref;
-int monomorphic;
-int *var_allele_counts;
+totals_t totals;
 bcf_hdr_t *header;
+int nthreads;
+hgsc_pool_t *pool;  // NULL unless --threads was given
+totals_t *thread_totals;  // one set per worker, added to totals in destroy()
+batch_t batches[2];  // process() fills one while the workers count the other
+int cur_batch;
+int batch_size;
+kstring_t rows;  // rows not yet written out, as CSV or as stored in a partial, see put_row() and flush_rows()
+char *partial_fname;  // --write-partial: save rows and totals here instead of printing them
+hgsc_partial_t partial;
+char *columnar_fname;  // --columnar: write the rows here instead of printing them
+hgsc_columnar_t columnar;
+hgsc_stats_t stats;  // --stats, see HGSC_stats.h
+const char *row_columns[NUM_ROW_COLUMNS] = {"chr", "pos", "pass_homref", "pass_hetvar", "pass_homvar", "fail_homref",
+                                            "fail_hetvar", "fail_homvar", "missing", "minor_allele_freq",
+                                            "is_monomorphic"};
+const int row_column_types[NUM_ROW_COLUMNS] = {HGSC_COL_STRING, HGSC_COL_INT32, HGSC_COL_INT32, HGSC_COL_INT32,
+                                               HGSC_COL_INT32, HGSC_COL_INT32, HGSC_COL_INT32, HGSC_COL_INT32,
+                                               HGSC_COL_INT32, HGSC_COL_FLOAT64, HGSC_COL_INT32};
+
+void read_cache(const char *fname);  // init() runs --from-cache through the same batches as process(), see below
 
 /*
  *     This short description is used to generate the output of `bcftools plugin -l`.
@@ -27,180 +102,592 @@ const char *about(void)
     printf("Prints per-variant summary stats for each variant, e.g. count of passing genotypes. Totals at bottom.");
 }
 
+const char *usage(void)
+{
+    return "Usage: bcftools +HGSC_variant_summary GENERAL_OPTIONS INPUT.bcf -- PLUGIN_OPTIONS\n"
+           "About:\n"
+           "\tPrints per-variant summary stats for each variant, e.g. count of passing genotypes. Totals at bottom.\n"
+           "\t--threads N counts records on N worker threads. Rows are still printed in input order.\n"
+           "\t--write-partial FILE saves the rows and totals to FILE instead of printing them, e.g. for one chromosome.\n"
+           "\t--merge prints the rows of the partials listed after the options, in the order given, then the combined totals.\n"
+           "\t    The partials must have the same samples; use a header-only input to merge.\n"
+           "\t--columnar FILE writes the rows to FILE as typed columns (see HGSC_columnar.h) instead of printing them.\n"
+           "\t    Only the totals are printed. Sites whose GT can't be read are left out.\n"
+           "\t--from-cache FILE prints the rows of a genotype cache made by HGSC_build_cache, without decoding the\n"
+           "\t    BCF it was made from. Give the BCF's header (e.g. from bcftools view -h) as the input.\n"
+           "\t--stats prints where the time went to stderr at the end, with a progress line every 10 seconds.\n"
+           "\t    --stats-json FILE writes the same summary to FILE as JSON.\n"
+           "bcftools +HGSC_variant_summary INPUT.bcf\n"
+           "bcftools +HGSC_variant_summary INPUT.bcf -- --threads 16\n"
+           "bcftools +HGSC_variant_summary INPUT.bcf -- --columnar variant_summary.col > totals.csv\n"
+           "bcftools +HGSC_variant_summary HEADER_ONLY.vcf -- --from-cache INPUT.gtc\n"
+           "bcftools +HGSC_variant_summary -r chr1 INPUT.bcf -- --write-partial chr1.part\n"
+           "bcftools +HGSC_variant_summary HEADER_ONLY.vcf -- --merge chr1.part chr2.part chrX.part\n";
+}
+
+/*
+ *     Add one row to the columnar output. counts are pass_homref through missing, in column order.
+ *     */
+void put_row_columns(const char *chr, int32_t pos, const int32_t *counts, double minor_allele_freq, bool is_monomorphic)
+{
+    int i;
+    hgsc_columnar_put_string(&columnar, chr);
+    hgsc_columnar_put_int32(&columnar, pos);
+    for (i = 0; i < 7; i++)
+        hgsc_columnar_put_int32(&columnar, counts[i]);
+    hgsc_columnar_put_float64(&columnar, minor_allele_freq);
+    hgsc_columnar_put_int32(&columnar, is_monomorphic);
+    hgsc_columnar_end_row(&columnar);
+}
+
+/*
+ *     Write out the rows put so far: to stdout, or as a length-prefixed block of the partial.
+ *     */
+void flush_rows(void)
+{
+    if (rows.l == 0)
+        return;
+
+    if (partial_fname != NULL)
+    {
+        int32_t len = rows.l;
+        hgsc_partial_write(&partial, &len, sizeof(len));
+        hgsc_partial_write(&partial, rows.s, rows.l);
+        hgsc_stats_output(&stats, sizeof(len) + rows.l);
+    }
+    else if (fwrite(rows.s, 1, rows.l, stdout) != rows.l)
+    {
+        error("Could not write rows\n");
+    }
+    else
+    {
+        hgsc_stats_output(&stats, rows.l);
+    }
+    rows.l = 0;
+}
+
+/*
+ *     Add one row to the output: as CSV, as typed columns with --columnar, or with --write-partial as its chr (NUL-
+ *     terminated) and then pos through is_monomorphic as int32s. A site without GT is an empty chr with nothing after
+ *     it, and prints as NO_GT_ROW. The partial keeps the allele counts rather than the rounded frequency, so a merge
+ *     writes exactly the rows a single pass would have, in either format.
+ *     */
+void put_row(const row_t *row)
+{
+    int i;
+    if (columnar_fname != NULL)
+    {
+        if (row->chr == NULL)
+            return;
+        double minor_allele_freq = NAN;  // no alleles observed; the CSV prints 0
+        if (row->total_alleles_observed != 0)
+            minor_allele_freq = row->allele1_count / (double) row->total_alleles_observed;
+        put_row_columns(row->chr, row->pos, row->counts, minor_allele_freq, row->is_monomorphic);
+        return;
+    }
+
+    if (partial_fname != NULL)
+    {
+        kputs(row->chr != NULL ? row->chr : "", &rows);
+        kputc(0, &rows);
+        if (row->chr != NULL)
+        {
+            kputsn((const char *) &row->pos, sizeof(row->pos), &rows);
+            kputsn((const char *) row->counts, sizeof(row->counts), &rows);
+            kputsn((const char *) &row->allele1_count, sizeof(row->allele1_count), &rows);
+            kputsn((const char *) &row->total_alleles_observed, sizeof(row->total_alleles_observed), &rows);
+            kputsn((const char *) &row->is_monomorphic, sizeof(row->is_monomorphic), &rows);
+        }
+    }
+    else if (row->chr == NULL)
+    {
+        kputs(NO_GT_ROW, &rows);
+    }
+    else
+    {
+        // printf("chr,pos,pass_homref,pass_hetvar,pass_homvar,fail_homref,fail_hetvar,fail_homvar,missing,minor_allele_freq,is_monomorphic\n");
+        // no format strings to parse on the per-site path
+        kputs(row->chr, &rows);
+        kputc(',', &rows);
+        kputw(row->pos, &rows);
+        for (i = 0; i < 7; i++)
+        {
+            kputc(',', &rows);
+            kputw(row->counts[i], &rows);
+        }
+        kputc(',', &rows);
+
+        if (row->total_alleles_observed != 0)
+            hgsc_kput_ratio6(row->allele1_count, row->total_alleles_observed, &rows);
+        else
+            kputc('0', &rows);
+        kputc(',', &rows);
+
+        if (row->is_monomorphic)
+            kputs("True\n", &rows);
+        else
+            kputs("False\n", &rows);
+    }
+
+    if (rows.l >= ROW_BLOCK)
+        flush_rows();
+}
+
+/*
+ *     Read the next int32 of a row stored by put_row() and step past it.
+ *     */
+static int32_t row_int(const char **p, const char *end, const char *fname)
+{
+    int32_t value;
+    if (end - *p < (long) sizeof(value))
+        error("Could not read a row of %s\n", fname);
+    memcpy(&value, *p, sizeof(value));
+    *p += sizeof(value);
+    return value;
+}
+
+/*
+ *     Put the rows of a partial into our own output and add its totals to ours.
+ *     */
+void merge_partial(const char *fname)
+{
+    hgsc_partial_t part;
+    hgsc_partial_open(&part, fname, PARTIAL_MAGIC, header);
+
+    kstring_t block = {0, 0, NULL};
+    int32_t len;
+    hgsc_partial_read(&part, &len, sizeof(len));
+    while (len > 0)  // a zero-length block ends the rows
+    {
+        if (ks_resize(&block, len) < 0)
+            error("Could not allocate %d bytes for rows\n", len);
+        hgsc_partial_read(&part, block.s, len);
+
+        const char *p = block.s, *end = block.s + len;
+        while (p < end)
+        {
+            row_t row;
+            const char *nul = memchr(p, 0, end - p);
+            if (nul == NULL)
+                error("Could not read a row of %s\n", fname);
+            row.chr = nul > p ? p : NULL;
+            p = nul + 1;
+            if (row.chr != NULL)
+            {
+                int i;
+                row.pos = row_int(&p, end, fname);
+                for (i = 0; i < 7; i++)
+                    row.counts[i] = row_int(&p, end, fname);
+                row.allele1_count = row_int(&p, end, fname);
+                row.total_alleles_observed = row_int(&p, end, fname);
+                row.is_monomorphic = row_int(&p, end, fname);
+            }
+            put_row(&row);
+        }
+        hgsc_partial_read(&part, &len, sizeof(len));
+    }
+    free(block.s);
+    flush_rows();
+
+    int32_t sites;
+    totals_t saved;
+    hgsc_partial_read(&part, &sites, sizeof(sites));
+    hgsc_partial_read(&part, &saved, sizeof(saved));
+    total_sites += sites;
+    totals.pass_het += saved.pass_het;
+    totals.pass_hom += saved.pass_hom;
+    totals.pass_ref += saved.pass_ref;
+    totals.missing += saved.missing;
+    totals.fail_het += saved.fail_het;
+    totals.fail_hom += saved.fail_hom;
+    totals.fail_ref += saved.fail_ref;
+    totals.monomorphic += saved.monomorphic;
+
+    hgsc_partial_close(&part);
+}
+
 /*
  *     Called once at startup, allows to initialize local variables.
  *         Return 1 to suppress VCF/BCF header from printing, 0 otherwise.
  *         */
 int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
 {
+    hgsc_stats_init(&stats, "HGSC_variant_summary", &argc, argv, in);
     nsamples = bcf_hdr_nsamples(in);
     total_sites = 0;
-    pass_het = 0;
-    pass_hom = 0;
-    pass_ref = 0;
-    fail_het = 0;
-    fail_hom = 0;
-    fail_ref = 0;
-    missing = 0;
-    monomorphic = 0;
+    memset(&totals, 0, sizeof(totals));
     header = in;
-    var_allele_counts = calloc(MAX_ALLELES, sizeof(int));
-    
-    printf("chr,pos,pass_homref,pass_hetvar,pass_homvar,fail_homref,fail_hetvar,fail_homvar,missing,minor_allele_freq,is_monomorphic\n");
+    nthreads = 0;
+    partial_fname = NULL;
+    columnar_fname = NULL;
+    char *cache_fname = NULL;
+    bool merge = false;
+
+    static struct option long_options[] =
+    {
+        {"help", no_argument, NULL, 'h'},
+        {"threads", required_argument, NULL, 't'},
+        {"write-partial", required_argument, NULL, 'w'},
+        {"merge", no_argument, NULL, 'm'},
+        {"columnar", required_argument, NULL, 'c'},
+        {"from-cache", required_argument, NULL, 'F'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    char *endptr;
+    while ((opt = getopt_long(argc, argv, "ht:w:mc:F:", long_options, NULL)) >= 0)
+    {
+        switch(opt)
+        {
+            case 't':
+                nthreads = strtol(optarg, &endptr, 10);
+                if (*endptr || nthreads < 1)
+                    error("Could not parse --threads %s\n", optarg);
+                break;
+            case 'w': partial_fname = optarg; break;
+            case 'm': merge = true; break;
+            case 'c': columnar_fname = optarg; break;
+            case 'F': cache_fname = optarg; break;
+            default: error("%s", usage()); break;
+        }
+    }
+    if (merge == (optind == argc))  // --merge needs partials, and only --merge takes them
+        error("%s", usage());
+    if (columnar_fname != NULL && partial_fname != NULL)
+        error("--columnar and --write-partial can't be used together\n");
+
+    batch_size = 1;
+    if (nthreads > 0)
+    {
+        batch_size = RECORDS_PER_THREAD * nthreads;
+        thread_totals = calloc(nthreads, sizeof(totals_t));
+        pool = hgsc_pool_init(nthreads);
+        if (thread_totals == NULL || pool == NULL)
+            error("Could not start %d threads.\n", nthreads);
+    }
+
+    batches[0].records = calloc(batch_size, sizeof(record_t));
+    batches[1].records = calloc(batch_size, sizeof(record_t));
+    cur_batch = 0;
+    memset(&rows, 0, sizeof(rows));
+    int i;
+    for (i = 0; i < batch_size; i++)
+    {
+        batches[0].records[i].decode.stats = &stats;
+        batches[1].records[i].decode.stats = &stats;
+    }
+
+    if (partial_fname != NULL)
+        hgsc_partial_create(&partial, partial_fname, PARTIAL_MAGIC, in);
+    else if (columnar_fname != NULL)
+        hgsc_columnar_create(&columnar, columnar_fname, NUM_ROW_COLUMNS, row_columns, row_column_types);
+    else
+        hgsc_stats_output(&stats, printf("chr,pos,pass_homref,pass_hetvar,pass_homvar,fail_homref,fail_hetvar,fail_homvar,missing,minor_allele_freq,is_monomorphic\n"));
+
+    for (i = optind; i < argc; i++)
+        merge_partial(argv[i]);
+    hgsc_stats_lap(&stats, HGSC_PHASE_SETUP);
+    if (cache_fname != NULL)
+        read_cache(cache_fname);
  
     return 1;
 }
 
 
 /*
- *     Called for each VCF record. Return rec to output the line or NULL
- *         to suppress output.
- *         */
-bcf1_t *process(bcf1_t *rec)
+ *     Add one sample's genotype to the row of r.
+ *     */
+static inline void count_genotype(record_t *r, bool is_pass, int all1, int all2)
 {
-    total_sites++;
+    bool valid1 = all1 >= 0 && all1 < r->n_allele;
+    bool valid2 = all2 >= 0 && all2 < r->n_allele;
 
-    int bcf_get_success_check;
+    r->total_alleles_observed += valid1 + valid2;
+    r->allele0_count += (all1 == 0) + (all2 == 0);
+    r->allele1_count += (valid1 && all1 == 1) + (valid2 && all2 == 1);
 
-    char **filter_data = NULL;
-    int32_t num_filter_data = 0;
-    bcf_get_success_check = bcf_get_format_string(header, rec, "FT", &filter_data, &num_filter_data);
- 
-    int32_t *gt_data = NULL;
-    int32_t num_gt_data = 0;
-    bcf_get_success_check = bcf_get_genotypes(header, rec, &gt_data, &num_gt_data);
+    if (all1 == 0 && all2 == 0)
+    {
+        if (is_pass)
+            r->var_ref_pass++;
+        else
+            r->var_ref_fail++;
+    }
+    else if (valid1 && valid2 && all1 != all2)
+    {
+        if (is_pass)
+            r->var_het_pass++;
+        else
+            r->var_het_fail++;
+    }
+    else if (valid1 && valid2)
+    {
+        if (is_pass)
+            r->var_hom_pass++;
+        else
+            r->var_hom_fail++;
+    }
+    else
+    {
+        r->var_miss++;
+    }
+}
 
-    // printf("numgtdata:%d, numfiltdata:%d\n", num_gt_data, num_filter_data);
+// count_genotypes_<width>_<ploidy>: every sample of r, reading GT at its packed width
+#define COUNT_GENOTYPES(suffix, gt_t, ploidy) \
+static void count_genotypes_##suffix(record_t *r) \
+{ \
+    const uint8_t *ft_codes = r->decode.ft_codes; \
+    const hgsc_fmt_view_t *gt = &r->decode.gt_view; \
+    int i; \
+    for (i = 0; i < nsamples; i++) \
+    { \
+        bool is_pass = ft_codes[i] == HGSC_FT_PASS || ft_codes[i] == HGSC_FT_NVAR; \
+        count_genotype(r, is_pass, HGSC_GT_ALLELE_P(gt_t, gt, ploidy, i, 0), \
+                       HGSC_GT_ALLELE_P(gt_t, gt, ploidy, i, 1)); \
+    } \
+}
+HGSC_FOR_EACH_WIDTH_PLOIDY(COUNT_GENOTYPES)
+
+/*
+ *     Count the genotypes of one decoded site into its row and into t.
+ *     */
+void count_record(totals_t *t, record_t *r)
+{
+    if (!r->has_gt)
+        return;
+
+    r->var_het_pass = 0;
+    r->var_hom_pass = 0;
+    r->var_ref_pass = 0;
+    r->var_het_fail = 0;
+    r->var_hom_fail = 0;
+    r->var_ref_fail = 0;
+    r->var_miss = 0;
+    r->allele0_count = 0;
+    r->allele1_count = 0;
+    r->total_alleles_observed = 0;
+    HGSC_GT_DISPATCH(&r->decode.gt_view, count_genotypes, r);
 
-    if (bcf_get_success_check <= 0)
+    t->pass_ref += r->var_ref_pass;
+    t->pass_het += r->var_het_pass;
+    t->pass_hom += r->var_hom_pass;
+    t->fail_ref += r->var_ref_fail;
+    t->fail_het += r->var_het_fail;
+    t->fail_hom += r->var_hom_fail;
+    t->missing += r->var_miss;
+
+    // all non-'.' alleles are '1'
+    r->is_monomorphic = r->allele0_count == 0 && r->allele1_count > 0 && r->allele1_count == r->total_alleles_observed;
+    if (r->is_monomorphic)
+        t->monomorphic++;
+}
+
+
+void print_record(const record_t *r)
+{
+    row_t row = {NULL};
+    if (r->has_gt)
     {
-        printf("Error getting gt");
-        return NULL;
+        int32_t counts[7] = {r->var_ref_pass, r->var_het_pass, r->var_hom_pass, r->var_ref_fail, r->var_het_fail,
+                             r->var_hom_fail, r->var_miss};
+        row.chr = bcf_hdr_id2name(header, r->rid);
+        row.pos = r->pos + 1;
+        memcpy(row.counts, counts, sizeof(counts));
+        row.allele1_count = r->allele1_count;
+        row.total_alleles_observed = r->total_alleles_observed;
+        row.is_monomorphic = r->is_monomorphic;
     }
+    put_row(&row);
+}
 
-    int var_het_pass = 0;
-    int var_hom_pass = 0;
-    int var_ref_pass = 0;
-    int var_het_fail = 0;
-    int var_hom_fail = 0;
-    int var_ref_fail = 0;
-    int var_miss = 0;
-    bool is_monomorphic = false;  // all non-'.' alleles are '1'
 
-    size_t i;
-    for (i = 0; i < MAX_ALLELES; i++)
-        var_allele_counts[i] = 0;
+/*
+ *     Pool job: worker `thread` counts its share of the batch into its own totals.
+ *     */
+void count_batch(void *arg, int thread, int nthreads)
+{
+    batch_t *batch = arg;
+    int start, end, i;
+    hgsc_pool_range(batch->n, thread, nthreads, &start, &end);
+    for (i = start; i < end; i++)
+        count_record(&thread_totals[thread], &batch->records[i]);
+}
 
-    for (i = 0; i < nsamples; i++)
-    {
-        int all1 = bcf_gt_allele(gt_data[2*i + 0]);
-        int all2 = bcf_gt_allele(gt_data[2*i + 1]);
-        bool is_pass = strcmp(filter_data[i], "PASS") == 0;
-        is_pass = is_pass || (strcmp(filter_data[i], "No_var") == 0);
 
-        if (all1 >= 0 && all1 < MAX_ALLELES)
-            var_allele_counts[all1]++;
-        if (all2 >= 0 && all1 < MAX_ALLELES)
-            var_allele_counts[all2]++;
+/*
+ *     Print the rows of the batch the workers finished last, then hand them the current one.
+ *     */
+void dispatch_batch(void)
+{
+    int i;
+    batch_t *done = &batches[cur_batch ^ 1];
 
-        if (all1 == 0 && all2 == 0)
-        {
-            if (is_pass)
-            {
-                pass_ref++;
-                var_ref_pass++;
-            }
-            else
-            {   
-                fail_ref++;
-                var_ref_fail++;
-            }
-        }
-        else if (all1 != all2 && all1 >= 0 && all2 >= 0 && all1 < MAX_ALLELES && all2 < MAX_ALLELES)
-        {
-            if (is_pass)
-            {
-                pass_het++;
-                var_het_pass++;
-            }
-            else
-            {   
-                fail_het++;
-                var_het_fail++;
-            }
-        }
-        else if (all1 == all2 && all1 >= 0 && all2 >= 0 && all1 < MAX_ALLELES && all2 < MAX_ALLELES)
-        {
-            if (is_pass)
-            {
-                pass_hom++;
-                var_hom_pass++;
-            }
-            else
-            {   
-                fail_hom++;
-                var_hom_fail++;
-            }
-        }
-        else
-        {
-            missing++;
-            var_miss++;
-        }
+    hgsc_pool_wait(pool);
+    hgsc_stats_lap(&stats, HGSC_PHASE_COUNT);
+    for (i = 0; i < done->n; i++)
+        print_record(&done->records[i]);
+    done->n = 0;
+    hgsc_stats_lap(&stats, HGSC_PHASE_OUTPUT);
+
+    hgsc_pool_start(pool, count_batch, &batches[cur_batch]);
+    cur_batch ^= 1;
+}
+
+
+/*
+ *     The slot for the next site in the batch being filled.
+ *     */
+record_t *next_record(void)
+{
+    total_sites++;
+    batch_t *batch = &batches[cur_batch];
+    return &batch->records[batch->n++];
+}
+
+/*
+ *     Count and print the site just decoded into r, the last slot of the batch being filled, or hand the batch to
+ *     the workers once it is full.
+ *     */
+void record_ready(record_t *r)
+{
+    if (pool == NULL)
+    {
+        count_record(&totals, r);
+        hgsc_stats_lap(&stats, HGSC_PHASE_COUNT);
+        print_record(r);
+        hgsc_stats_lap(&stats, HGSC_PHASE_OUTPUT);
+        batches[cur_batch].n = 0;
     }
+    else if (batches[cur_batch].n == batch_size)
+    {
+        dispatch_batch();
+    }
+}
 
 
-    int non_1_allele_sum = 0;
-    for (i = 2; i < MAX_ALLELES; i++)
-        non_1_allele_sum += var_allele_counts[i];
+/*
+ *     Count and print every site of the --from-cache file, as if its records came before the input's.
+ *     */
+void read_cache(const char *fname)
+{
+    hgsc_cache_t cache;
+    hgsc_cache_open(&cache, fname, header);
 
-    if (var_allele_counts[0] == 0 && var_allele_counts[1] > 0 && non_1_allele_sum == 0)
+    uint64_t j;
+    for (j = 0; j < cache.nsites; j++)
     {
-        is_monomorphic = true;
-        monomorphic++;
+        record_t *r = next_record();
+        r->rid = hgsc_cache_rid(&cache, j);
+        hgsc_stats_record(&stats, r->rid, hgsc_cache_site(&cache, j)->pos);
+        r->pos = hgsc_cache_site(&cache, j)->pos;
+        r->n_allele = hgsc_cache_site(&cache, j)->n_allele;
+        r->has_gt = (hgsc_cache_decode(&cache, j, &r->decode, FORMAT_FIELDS) & HGSC_FIELD_GT_VIEW) != 0;
+        record_ready(r);
     }
 
-    // printf("chr,pos,pass_homref,pass_hetvar,pass_homvar,fail_homref,fail_hetvar,fail_homvar,missing,minor_allele_freq,is_monomorphic\n");
-    printf("%s,", bcf_hdr_id2name(header, rec->rid));
-    printf("%d,", rec->pos + 1);
-    printf("%d,", var_ref_pass);
-    printf("%d,", var_het_pass);
-    printf("%d,", var_hom_pass);
-    printf("%d,", var_ref_fail);
-    printf("%d,", var_het_fail);
-    printf("%d,", var_hom_fail);
-    printf("%d,", var_miss);
+    hgsc_cache_close(&cache);
+}
 
-    int total_alleles_observed = 0;
-    for(i = 0; i < MAX_ALLELES; i++)
-        total_alleles_observed += var_allele_counts[i];
-    if (total_alleles_observed != 0)
-        printf("%lf,", var_allele_counts[1] / (double) total_alleles_observed);
-    else
-        printf("0,");
 
-    if (is_monomorphic)
-        printf("True\n");
-    else
-        printf("False\n");
+/*
+ *     Called for each VCF record. Return rec to output the line or NULL
+ *         to suppress output.
+ *         */
+bcf1_t *process(bcf1_t *rec)
+{
+    hgsc_stats_lap(&stats, HGSC_PHASE_BCFTOOLS);
+    hgsc_stats_record(&stats, rec->rid, rec->pos);
+    record_t *r = next_record();
+    r->rid = rec->rid;
+    r->pos = rec->pos;
+    r->n_allele = rec->n_allele;
 
-    free(gt_data);
-    free(filter_data[0]);
-    free(filter_data);
+    // GT only needs copying out of rec if another thread counts it later
+    int decoded = hgsc_decode_fields(&r->decode, header, rec, nsamples, FORMAT_FIELDS | (pool != NULL ? HGSC_FIELD_KEEP : 0));
 
+    // printf("numgtdata:%d, numfiltdata:%d\n", num_gt_data, num_filter_data);
+
+    r->has_gt = (decoded & HGSC_FIELD_GT_VIEW) != 0;
+
+    record_ready(r);
     return NULL;
 }
 
 
+void print_totals(void)
+{
+    int pass_het = totals.pass_het;
+    int pass_hom = totals.pass_hom;
+    int pass_ref = totals.pass_ref;
+    int fail_het = totals.fail_het;
+    int fail_hom = totals.fail_hom;
+    int fail_ref = totals.fail_ref;
+    int monomorphic = totals.monomorphic;
+
+    hgsc_stats_output(&stats, printf("TOTALS:\n"));
+    hgsc_stats_output(&stats, printf("num_samples,num_variant_sites,pass_homref,pass_hetvar,pass_homvar,fail_homref,fail_hetvar,fail_homvar,"
+           "het_hom_ratio,pass_het_hom_ratio,fail_het_hom_ratio,monomorphic_sites\n"));
+    hgsc_stats_output(&stats, printf("%d,%d,%d,%d,%d,%d,%d,%d,%lf,%lf,%lf,%d\n", nsamples, total_sites, pass_ref, pass_het, pass_hom, fail_ref, fail_het, fail_hom,
+           (pass_het + fail_het) / (double) (pass_hom + fail_hom), pass_het / (double) pass_hom, 
+           fail_het / (double) fail_hom,  monomorphic));
+}
+
+
 /*
  *     Clean up.
  *     */
 void destroy(void)
 {
-    printf("TOTALS:\n");
-    printf("num_samples,num_variant_sites,pass_homref,pass_hetvar,pass_homvar,fail_homref,fail_hetvar,fail_homvar,"
-           "het_hom_ratio,pass_het_hom_ratio,fail_het_hom_ratio,monomorphic_sites\n");
-    printf("%d,%d,%d,%d,%d,%d,%d,%d,%lf,%lf,%lf,%d\n", nsamples, total_sites, pass_ref, pass_het, pass_hom, fail_ref, fail_het, fail_hom,
-           (pass_het + fail_het) / (double) (pass_hom + fail_hom), pass_het / (double) pass_hom, 
-           fail_het / (double) fail_hom,  monomorphic);
+    int i;
+    hgsc_stats_lap(&stats, HGSC_PHASE_BCFTOOLS);
+    if (pool != NULL)
+    {
+        if (batches[cur_batch].n > 0)
+            dispatch_batch();
+        dispatch_batch();  // prints the last batch; the one it starts is empty
+
+        for (i = 0; i < nthreads; i++)
+        {
+            totals.pass_het += thread_totals[i].pass_het;
+            totals.pass_hom += thread_totals[i].pass_hom;
+            totals.pass_ref += thread_totals[i].pass_ref;
+            totals.missing += thread_totals[i].missing;
+            totals.fail_het += thread_totals[i].fail_het;
+            totals.fail_hom += thread_totals[i].fail_hom;
+            totals.fail_ref += thread_totals[i].fail_ref;
+            totals.monomorphic += thread_totals[i].monomorphic;
+        }
+        free(thread_totals);
+        hgsc_pool_destroy(pool);
+    }
+
+    flush_rows();
+    free(rows.s);
+    if (columnar_fname != NULL)
+        hgsc_columnar_close(&columnar);
+
+    if (partial_fname != NULL)
+    {
+        int32_t end_of_rows = 0;
+        int32_t sites = total_sites;
+        hgsc_partial_write(&partial, &end_of_rows, sizeof(end_of_rows));
+        hgsc_partial_write(&partial, &sites, sizeof(sites));
+        hgsc_partial_write(&partial, &totals, sizeof(totals));
+        hgsc_partial_close(&partial);
+    }
+    else
+    {
+        print_totals();
+    }
+    hgsc_stats_lap(&stats, HGSC_PHASE_OUTPUT);
+
+    for (i = 0; i < batch_size; i++)
+    {
+        hgsc_decode_destroy(&batches[0].records[i].decode);
+        hgsc_decode_destroy(&batches[1].records[i].decode);
+    }
+    free(batches[0].records);
+    free(batches[1].records);
+    hgsc_stats_report(&stats);
 }
@@ -1,12 +1,110 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <unistd.h>
 //#include "../htslib-1.6/htslib/vcf.h"
 #include <htslib/vcf.h>
+#include <htslib/bgzf.h>
+#include <htslib/kstring.h>
+#include "bcftools.h"
+#include "HGSC_common.h"
+#include "HGSC_cache.h"
 
-int nsamples;
+#define OUT_BLOCK 65536  // rows are written out once this many bytes are buffered
+#define MATRIX_MAGIC "HGSCGTM\x01"  // binary matrix file, format version 1
+#define MATRIX_ALIGN 64  // the matrix starts on a multiple of this, so it can be mapped straight into an array
+#define SITES_PER_BLOCK 4096  // --sample-major buffers this many sites before transposing them out to the spill file
+#define TILE_BYTES 64  // transpose tiles are TILE_BYTES x TILE_BYTES packed bytes, i.e. 256 sites x 256 samples
+#define MERGE_MEMORY (64 << 20)  // bytes of spilled rows read back at once when writing out --sample-major rows
+
+// --format
+#define FORMAT_CSV 0
+#define FORMAT_2BIT 1  // 4 genotypes per byte, first sample in the low bits: 0 = 0/0, 1 = het, 2 = hom-var, 3 = no call
+#define FORMAT_INT8 2  // twice the CSV value: -20, 0, 1, 2
+#define FORMAT_FLOAT32 3  // the CSV values: -10, 0, 0.5, 1
+
+// Genotype codes, and the text each one is written as.
+#define GT_CODE_NO_CALL 0  // failed FT or missing allele
+#define GT_CODE_HOMREF 1
+#define GT_CODE_HET 2
+#define GT_CODE_HOMVAR 3
+#define GT_CODE_BAD 4  // Something is terribly wrong, probably?
+#define GT_CODE_NUM 5
+
+typedef struct
+{
+    char s[8];  // the value followed by a comma; the comma becomes a newline at the end of a row
+    int len;
+} token_t;
+
+const token_t tokens[GT_CODE_NUM] =
+{
+    {"-10,", 4},
+    {"0,", 2},
+    {"0.5,", 4},
+    {"1,", 2},
+    {"-100,", 5},
+};
 
+// The same codes in the binary formats. FORMAT_2BIT and FORMAT_INT8 have no room for GT_CODE_BAD, which can't
+// actually happen, so it is written as a no call.
+const uint8_t codes_2bit[GT_CODE_NUM] = {3, 0, 1, 2, 3};
+const int8_t codes_int8[GT_CODE_NUM] = {-20, 0, 1, 2, -20};
+const float codes_float32[GT_CODE_NUM] = {-10.0f, 0.0f, 0.5f, 1.0f, -100.0f};
+const uint8_t gt_code_of_2bit[4] = {GT_CODE_HOMREF, GT_CODE_HET, GT_CODE_HOMVAR, GT_CODE_NO_CALL};
+
+/*
+ *     Start of a binary matrix file. Numbers are in native byte order and offsets are from the start of the file:
+ *
+ *         samples_offset: nsamples NUL-terminated sample names
+ *         matrix_offset:  rows of row_bytes bytes (a multiple of MATRIX_ALIGN). With layout 0 there are nsites
+ *                         rows, one per site, in input order. With layout 1 (--sample-major) there are nsamples
+ *                         rows, one per sample, each holding every site in input order.
+ *         sites_offset:   nsites pairs of int32 contig index and 1-based int32 position
+ *         contigs_offset: uint32 number of contigs, then the NUL-terminated contig names
+ *
+ *     e.g. numpy.memmap(fname, dtype=numpy.int8, offset=matrix_offset, shape=(nsites, nsamples)) for FORMAT_INT8.
+ *     */
+typedef struct
+{
+    char magic[8];
+    uint32_t format;  // FORMAT_2BIT, FORMAT_INT8 or FORMAT_FLOAT32
+    uint32_t layout;  // 0: one row per site, 1: one row per sample
+    uint64_t nsamples;
+    uint64_t nsites;
+    uint64_t row_bytes;
+    uint64_t samples_offset;
+    uint64_t matrix_offset;
+    uint64_t sites_offset;
+    uint64_t contigs_offset;
+} matrix_header_t;
+
+int nsamples;
+hgsc_decode_t decode;
 
 bcf_hdr_t *header;
+FILE *out_fp;  // plain output, or NULL when writing through out_bgzf
+BGZF *out_bgzf;
+char *out_fname;
+kstring_t out_buf;  // rows not yet written out
+int format;
+uint8_t *gt_codes;  // GT_CODE_* of each sample in the current record
+matrix_header_t matrix_header;
+kstring_t sites;  // pairs of contig index and position, for the binary matrix or the --sample-major CSV header
+uint64_t nsites;
+int sample_major;
+uint8_t *block;  // --sample-major: up to SITES_PER_BLOCK sites of 2-bit codes, one row of (nsamples + 3) / 4 bytes per site
+uint8_t *transposed;  // the same block, one row of SITES_PER_BLOCK / 4 bytes per sample
+int block_nsites;
+int nblocks;
+FILE *spill_fp;  // transposed blocks, one after another
+char *temp_dir;
+hgsc_stats_t stats;  // --stats, see HGSC_stats.h
+
+void read_cache(const char *fname);  // init() outputs the --from-cache sites the same way as process(), see below
+
 /*
  *     This short description is used to generate the output of `bcftools plugin -l`.
  *     */
@@ -15,103 +113,606 @@ const char *about(void)
     return "";
 }
 
+const char *usage(void)
+{
+    return "Usage: bcftools +HGSC_vcf2csv GENERAL_OPTIONS INPUT.bcf -- PLUGIN_OPTIONS\n"
+           "About:\n"
+           "\tPrints out a CSV of genotypes. Use at your peril!\n"
+           "\t-10 is a failed or missing genotype, 0 is 0/0, 0.5 is a het and 1 is a hom-var.\n"
+           "\t--output FILE writes to FILE instead of stdout.\n"
+           "\t--bgzip compresses the output with bgzip.\n"
+           "\t--buffer-size N sets the size of the stdio buffer for uncompressed output, in bytes.\n"
+           "\t--format csv|2bit|int8|float32 picks the output. The binary formats write a matrix with one row per site\n"
+           "\t    that can be memory-mapped directly; they need --output and can't be used with --bgzip.\n"
+           "\t    2bit packs 4 genotypes per byte (0 = 0/0, 1 = het, 2 = hom-var, 3 = no call), int8 is twice\n"
+           "\t    the CSV value and float32 is the CSV value. See matrix_header_t in HGSC_vcf2csv.c for the layout.\n"
+           "\t--sample-major writes one row per sample instead of one per site. Sites are spilled to a temporary\n"
+           "\t    file in --temp-dir (default $TMPDIR or /tmp) so memory use doesn't grow with the number of sites.\n"
+           "\t    The CSV rows start with the sample name and the header names each site as contig:position.\n"
+           "\t--from-cache FILE outputs the sites of a genotype cache made by HGSC_build_cache, without decoding the\n"
+           "\t    BCF it was made from. Give the BCF's header (e.g. from bcftools view -h) as the input.\n"
+           "\t--stats prints where the time went to stderr at the end, with a progress line every 10 seconds.\n"
+           "\t    --stats-json FILE writes the same summary to FILE as JSON.\n"
+           "bcftools +HGSC_vcf2csv INPUT.bcf > genotypes.csv\n"
+           "bcftools +HGSC_vcf2csv INPUT.bcf -- --bgzip --output genotypes.csv.gz\n"
+           "bcftools +HGSC_vcf2csv INPUT.bcf -- --format int8 --output genotypes.i8\n"
+           "bcftools +HGSC_vcf2csv INPUT.bcf -- --sample-major --format 2bit --output genotypes.2bit\n"
+           "bcftools +HGSC_vcf2csv HEADER_ONLY.vcf -- --from-cache INPUT.gtc --format int8 --output genotypes.i8\n";
+}
+
+/*
+ *     Write out whatever is in out_buf.
+ *     */
+void flush_out(void)
+{
+    if (out_buf.l == 0)
+        return;
+
+    size_t written;
+    if (out_bgzf != NULL)
+        written = bgzf_write(out_bgzf, out_buf.s, out_buf.l) == (ssize_t) out_buf.l ? out_buf.l : 0;
+    else
+        written = fwrite(out_buf.s, 1, out_buf.l, out_fp);
+    if (written != out_buf.l)
+        error("Could not write to %s\n", out_fname ? out_fname : "stdout");
+    hgsc_stats_output(&stats, out_buf.l);
+    out_buf.l = 0;
+}
+
+/*
+ *     Bytes in a binary matrix row of n genotypes.
+ *     */
+uint64_t matrix_row_bytes(uint64_t n)
+{
+    if (format == FORMAT_2BIT)
+        return (n + 3) / 4;
+    else if (format == FORMAT_INT8)
+        return n * sizeof(int8_t);
+    else
+        return n * sizeof(float);
+}
+
+/*
+ *     Write the matrix header and sample names and pad up to the start of the matrix.
+ *     */
+void start_matrix(void)
+{
+    matrix_header_t *h = &matrix_header;
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, MATRIX_MAGIC, sizeof(h->magic));
+    h->format = format;
+    h->layout = sample_major;
+    h->nsamples = nsamples;
+    h->row_bytes = matrix_row_bytes(sample_major ? 0 : nsamples);  // --sample-major rows are sized once all sites are in
+
+    // filled in by finish_matrix()
+    kputsn_((char *) h, sizeof(*h), &out_buf);
+
+    int i;
+    h->samples_offset = out_buf.l;
+    for (i = 0; i < nsamples; i++)
+        kputsn_(header->samples[i], strlen(header->samples[i]) + 1, &out_buf);
+
+    while (out_buf.l % MATRIX_ALIGN != 0)
+        kputc_(0, &out_buf);
+    h->matrix_offset = out_buf.l;
+
+}
+
+/*
+ *     Write the sites and contigs after the matrix, then go back and fill in the header.
+ *     */
+void finish_matrix(void)
+{
+    matrix_header_t *h = &matrix_header;
+    h->nsites = nsites;
+    h->sites_offset = h->matrix_offset + (sample_major ? nsamples : nsites) * h->row_bytes;
+    flush_out();
+    if (fwrite(sites.s, 1, sites.l, out_fp) != sites.l)
+        error("Could not write to %s\n", out_fname);
+    hgsc_stats_output(&stats, sites.l);
+
+    h->contigs_offset = h->sites_offset + sites.l;
+    uint32_t ncontigs = header->n[BCF_DT_CTG];
+    kputsn_(&ncontigs, sizeof(ncontigs), &out_buf);
+    int i;
+    for (i = 0; i < ncontigs; i++)
+        kputsn_(bcf_hdr_id2name(header, i), strlen(bcf_hdr_id2name(header, i)) + 1, &out_buf);
+    flush_out();
+
+    if (fseek(out_fp, 0, SEEK_SET) != 0 || fwrite(h, sizeof(*h), 1, out_fp) != 1)
+        error("Could not write the header of %s\n", out_fname);
+}
+
+/*
+ *     Set up the block buffers and the spill file for --sample-major.
+ *     */
+void start_spill(void)
+{
+    block = calloc((size_t) SITES_PER_BLOCK * ((nsamples + 3) / 4) + 1, 1);
+    transposed = calloc((size_t) nsamples * (SITES_PER_BLOCK / 4) + 1, 1);
+    if (block == NULL || transposed == NULL)
+        error("Could not allocate a %d site block for %d samples\n", SITES_PER_BLOCK, nsamples);
+    block_nsites = 0;
+    nblocks = 0;
+
+    kstring_t fname = {0, 0, NULL};
+    ksprintf(&fname, "%s/HGSC_vcf2csv.XXXXXX", temp_dir);
+    int fd = mkstemp(fname.s);
+    if (fd < 0)
+        error("Could not create a temporary file in %s\n", temp_dir);
+    unlink(fname.s);  // goes away when closed
+    spill_fp = fdopen(fd, "w+");
+    if (spill_fp == NULL)
+        error("Could not open temporary file %s\n", fname.s);
+    free(fname.s);
+}
+
+/*
+ *     Transpose the buffered block so each sample's sites are contiguous and append it to the spill file. Both sides
+ *     are 2-bit packed, so the work is done on 4 x 4 genotype squares (4 bytes in, 4 bytes out), one tile of those at
+ *     a time so both buffers stay in cache.
+ *     */
+void spill_block(void)
+{
+    int in_row = (nsamples + 3) / 4;  // bytes per site in block
+    int out_row = (block_nsites + 3) / 4;  // bytes per sample in transposed
+    int nrows = out_row * 4;
+
+    // sites past the end of a short last block read as 0/0 and are never written out
+    memset(block + (size_t) block_nsites * in_row, 0, (size_t) (nrows - block_nsites) * in_row);
+
+    int sb0, jb0, sb, jb, k;
+    for (sb0 = 0; sb0 < in_row; sb0 += TILE_BYTES)
+    {
+        int sb1 = sb0 + TILE_BYTES < in_row ? sb0 + TILE_BYTES : in_row;
+        for (jb0 = 0; jb0 < out_row; jb0 += TILE_BYTES)
+        {
+            int jb1 = jb0 + TILE_BYTES < out_row ? jb0 + TILE_BYTES : out_row;
+            for (sb = sb0; sb < sb1; sb++)
+            {
+                for (jb = jb0; jb < jb1; jb++)
+                {
+                    const uint8_t *in = block + (size_t) 4 * jb * in_row + sb;
+                    uint8_t in0 = in[0], in1 = in[in_row], in2 = in[2 * in_row], in3 = in[3 * in_row];
+                    for (k = 0; k < 4 && 4 * sb + k < nsamples; k++)
+                    {
+                        int shift = 2 * k;
+                        transposed[(size_t) (4 * sb + k) * out_row + jb] = ((in0 >> shift) & 3)
+                                                                           | ((in1 >> shift) & 3) << 2
+                                                                           | ((in2 >> shift) & 3) << 4
+                                                                           | ((in3 >> shift) & 3) << 6;
+                    }
+                }
+            }
+        }
+    }
+
+    size_t len = (size_t) nsamples * out_row;
+    if (fwrite(transposed, 1, len, spill_fp) != len)
+        error("Could not write to the temporary file in %s\n", temp_dir);
+    nblocks++;
+    block_nsites = 0;
+}
+
 /*
  *     Called once at startup, allows to initialize local variables.
  *         Return 1 to suppress VCF/BCF header from printing, 0 otherwise.
  *         */
 int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
 {
+    hgsc_stats_init(&stats, "HGSC_vcf2csv", &argc, argv, in);
     nsamples = bcf_hdr_nsamples(in);
     header = in;
-   
-    if (argc != 1)
+    out_fname = NULL;
+    decode.stats = &stats;
+    int bgzip = 0;
+    long buffer_size = 0;
+    format = FORMAT_CSV;
+    sample_major = 0;
+    temp_dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    char *cache_fname = NULL;
+
+    static struct option long_options[] =
+    {
+        {"help", no_argument, NULL, 'h'},
+        {"output", required_argument, NULL, 'o'},
+        {"bgzip", no_argument, NULL, 'z'},
+        {"buffer-size", required_argument, NULL, 'b'},
+        {"format", required_argument, NULL, 'f'},
+        {"sample-major", no_argument, NULL, 's'},
+        {"temp-dir", required_argument, NULL, 'T'},
+        {"from-cache", required_argument, NULL, 'F'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    char *endptr;
+    while ((opt = getopt_long(argc, argv, "ho:zb:f:sT:F:", long_options, NULL)) >= 0)
     {
-        printf("Prints out a CSV of genotypes. Use at your peril!");
-        exit(1);
+        switch(opt)
+        {
+            case 'o': out_fname = optarg; break;
+            case 'z': bgzip = 1; break;
+            case 'b':
+                buffer_size = strtol(optarg, &endptr, 10);
+                if (*endptr || buffer_size < 1)
+                    error("Could not parse --buffer-size %s\n", optarg);
+                break;
+            case 'f':
+                if (strcmp(optarg, "csv") == 0)
+                    format = FORMAT_CSV;
+                else if (strcmp(optarg, "2bit") == 0)
+                    format = FORMAT_2BIT;
+                else if (strcmp(optarg, "int8") == 0)
+                    format = FORMAT_INT8;
+                else if (strcmp(optarg, "float32") == 0)
+                    format = FORMAT_FLOAT32;
+                else
+                    error("Unknown --format %s\n", optarg);
+                break;
+            case 's': sample_major = 1; break;
+            case 'T': temp_dir = optarg; break;
+            case 'F': cache_fname = optarg; break;
+            default: error("%s", usage()); break;
+        }
     }
-  
-    //printf("var_id,var_type,");
- 
-    int i;
-    for (i = 0; i < nsamples; i++)
+    if (optind != argc)
+        error("%s", usage());
+    if (format != FORMAT_CSV && (out_fname == NULL || bgzip))
+        error("The binary --format options need --output and can't be used with --bgzip\n");
+
+    out_fp = NULL;
+    out_bgzf = NULL;
+    if (bgzip)
+    {
+        fflush(stdout);
+        out_bgzf = out_fname ? bgzf_open(out_fname, "w") : bgzf_dopen(fileno(stdout), "w");
+        if (out_bgzf == NULL)
+            error("Could not open %s\n", out_fname ? out_fname : "stdout");
+    }
+    else
     {
-        printf("%s", header->samples[i]);
+        out_fp = out_fname ? fopen(out_fname, "w") : stdout;
+        if (out_fp == NULL)
+            error("Could not open %s\n", out_fname);
+        if (buffer_size > 0 && setvbuf(out_fp, NULL, _IOFBF, buffer_size) != 0)
+            error("Could not set a %ld byte output buffer\n", buffer_size);
+    }
+    memset(&out_buf, 0, sizeof(out_buf));
 
-        if (i != nsamples - 1)
-            printf(",");
-        else
-            printf("\n");
+    gt_codes = malloc(nsamples + 1);
+    if (gt_codes == NULL)
+        error("Could not allocate genotype codes for %d samples\n", nsamples);
+    memset(&sites, 0, sizeof(sites));
+    nsites = 0;
 
+    if (sample_major)
+        start_spill();
+
+    if (format != FORMAT_CSV)
+    {
+        start_matrix();
     }
- 
+    else if (!sample_major)  // the --sample-major header needs every site, see write_sample_major()
+    {
+        //printf("var_id,var_type,");
+
+        int i;
+        for (i = 0; i < nsamples; i++)
+        {
+            kputs(header->samples[i], &out_buf);
+
+            if (i != nsamples - 1)
+                kputc(',', &out_buf);
+            else
+                kputc('\n', &out_buf);
+
+        }
+    }
+
+    hgsc_stats_lap(&stats, HGSC_PHASE_SETUP);
+    if (cache_fname != NULL)
+        read_cache(cache_fname);
+
     return 1;
     //return 0;
 }
 
 
+/*
+ *     The GT_CODE_* of one genotype.
+ *     */
+static inline int genotype_code(uint8_t ft_code, int all1, int all2)
+{
+    if (ft_code != HGSC_FT_PASS && ft_code != HGSC_FT_NVAR)
+        return GT_CODE_NO_CALL;
+    else if (all1 < 0 || all2 < 0)
+        return GT_CODE_NO_CALL;
+    else if (all1 == 0 && all2 == 0)
+        return GT_CODE_HOMREF;
+    else if (all1 != all2)
+        return GT_CODE_HET;
+    else if (all1 == all2)
+        return GT_CODE_HOMVAR;
+    else
+        return GT_CODE_BAD;
+}
+
+// genotype_codes_<width>_<ploidy>: fill gt_codes from GT at its packed width
+#define GENOTYPE_CODES(suffix, gt_t, ploidy) \
+static void genotype_codes_##suffix(const hgsc_fmt_view_t *gt, const uint8_t *ft_codes) \
+{ \
+    int i; \
+    for (i = 0; i < nsamples; i++) \
+        gt_codes[i] = genotype_code(ft_codes[i], HGSC_GT_ALLELE_P(gt_t, gt, ploidy, i, 0), \
+                                    HGSC_GT_ALLELE_P(gt_t, gt, ploidy, i, 1)); \
+}
+HGSC_FOR_EACH_WIDTH_PLOIDY(GENOTYPE_CODES)
+
+
+/*
+ *     Append the CSV row for gt_codes to out_buf.
+ *     */
+void put_csv_row(void)
+{
+    if (nsamples == 0)
+        return;
+
+    // room for the longest token for every sample, so the loop below never has to check
+    if (ks_resize(&out_buf, out_buf.l + nsamples * sizeof(tokens[0].s)) < 0)
+        error("Could not allocate the output buffer\n");
+
+    char *p = out_buf.s + out_buf.l;
+    int i;
+    for (i = 0; i < nsamples; i++)
+    {
+        const token_t *token = &tokens[gt_codes[i]];
+        memcpy(p, token->s, sizeof(token->s));  // fixed size copy; only len bytes are kept
+        p += token->len;
+    }
+    p[-1] = '\n';
+    out_buf.l = p - out_buf.s;
+}
+
+/*
+ *     Pack gt_codes 4 to a byte, first sample in the low bits.
+ *     */
+void pack_2bit(uint8_t *packed)
+{
+    memset(packed, 0, (nsamples + 3) / 4);
+    int i;
+    for (i = 0; i < nsamples; i++)
+        packed[i >> 2] |= codes_2bit[gt_codes[i]] << (2 * (i & 3));
+}
+
+/*
+ *     Append the matrix row for gt_codes to out_buf.
+ *     */
+void put_matrix_row(void)
+{
+    if (ks_resize(&out_buf, out_buf.l + matrix_header.row_bytes) < 0)
+        error("Could not allocate the output buffer\n");
+
+    char *row = out_buf.s + out_buf.l;
+    int i;
+    if (format == FORMAT_2BIT)
+    {
+        pack_2bit((uint8_t *) row);
+    }
+    else if (format == FORMAT_INT8)
+    {
+        for (i = 0; i < nsamples; i++)
+            row[i] = codes_int8[gt_codes[i]];
+    }
+    else
+    {
+        for (i = 0; i < nsamples; i++)
+            memcpy(row + i * sizeof(float), &codes_float32[gt_codes[i]], sizeof(float));
+    }
+    out_buf.l += matrix_header.row_bytes;
+}
+
+/*
+ *     Add gt_codes to the --sample-major block, spilling it when it's full.
+ *     */
+void put_block_row(void)
+{
+    pack_2bit(block + (size_t) block_nsites * ((nsamples + 3) / 4));
+    if (++block_nsites == SITES_PER_BLOCK)
+        spill_block();
+}
+
+
+/*
+ *     Output the genotypes in gt_codes as the site at 0-based pos of contig rid.
+ *     */
+void put_site(int32_t rid, int32_t pos)
+{
+    if (sample_major)
+        put_block_row();
+    else if (format == FORMAT_CSV)
+        put_csv_row();
+    else
+        put_matrix_row();
+
+    int32_t site[2] = {rid, pos + 1};
+    if (sample_major || format != FORMAT_CSV)
+        kputsn_(site, sizeof(site), &sites);
+    nsites++;
+
+    if (out_buf.l >= OUT_BLOCK)
+        flush_out();
+    hgsc_stats_lap(&stats, HGSC_PHASE_OUTPUT);
+}
+
+
 /*
  *     Called for each VCF record. Return rec to output the line or NULL
  *         to suppress output.
  *         */
 bcf1_t *process(bcf1_t *rec)
 {
+    hgsc_stats_lap(&stats, HGSC_PHASE_BCFTOOLS);
+    hgsc_stats_record(&stats, rec->rid, rec->pos);
     int bcf_get_success_check;
 
     char* var_id = rec->d.id;
     char* sv_type = rec->d.allele[1];
 
-    int32_t *gt_data = NULL;
-    int32_t num_gt_data = 0;
-    bcf_get_success_check = bcf_get_genotypes(header, rec, &gt_data, &num_gt_data);
-
-    char **filter_data = NULL;
-    int32_t num_filter_data = 0;
-    bcf_get_success_check = bcf_get_format_string(header, rec, "FT", &filter_data, &num_filter_data);
+    // FT first: GT is only needed if some sample passed
+    bcf_get_success_check = hgsc_decode_fields(&decode, header, rec, nsamples, HGSC_FIELD_FT);
+    uint8_t *ft_codes = decode.ft_codes;
 
     //printf("%s,%s,", var_id, sv_type);
 
-    int i;
-    for (i = 0; i < nsamples; i++)
+    if (!hgsc_any_ft(&decode, nsamples, HGSC_FT_PASSING)
+        || !(hgsc_decode_fields(&decode, header, rec, nsamples, HGSC_FIELD_GT_VIEW) & HGSC_FIELD_GT_VIEW))
     {
-        int all1 = bcf_gt_allele(gt_data[2*i + 0]);
-        int all2 = bcf_gt_allele(gt_data[2*i + 1]);
+        memset(gt_codes, GT_CODE_NO_CALL, nsamples);
+    }
+    else
+    {
+        HGSC_GT_DISPATCH(&decode.gt_view, genotype_codes, &decode.gt_view, ft_codes);
+    }
+    hgsc_stats_lap(&stats, HGSC_PHASE_COUNT);
 
-        if ((strcmp(filter_data[i], "PASS") != 0) && (strcmp(filter_data[i], "No_var") != 0))
-        {
-            printf("-10");
-        }
-        else if (all1 < 0 || all2 < 0)
-        {
-            printf("-10");
-        }
-        else if (all1 == 0 && all2 == 0)
+    put_site(rec->rid, rec->pos);
+    return NULL;
+}
+
+
+/*
+ *     Output every site of the --from-cache file, as if its records came before the input's.
+ *     */
+void read_cache(const char *fname)
+{
+    hgsc_cache_t cache;
+    hgsc_cache_open(&cache, fname, header);
+
+    uint64_t j;
+    for (j = 0; j < cache.nsites; j++)
+    {
+        int32_t rid = hgsc_cache_rid(&cache, j), pos = hgsc_cache_site(&cache, j)->pos;
+        hgsc_stats_record(&stats, rid, pos);
+        hgsc_cache_decode(&cache, j, &decode, HGSC_FIELD_FT);
+        if (!hgsc_any_ft(&decode, nsamples, HGSC_FT_PASSING)
+            || !(hgsc_cache_decode(&cache, j, &decode, HGSC_FIELD_GT_VIEW) & HGSC_FIELD_GT_VIEW))
+            memset(gt_codes, GT_CODE_NO_CALL, nsamples);
+        else
+            HGSC_GT_DISPATCH(&decode.gt_view, genotype_codes, &decode.gt_view, decode.ft_codes);
+        hgsc_stats_lap(&stats, HGSC_PHASE_COUNT);
+
+        put_site(rid, pos);
+    }
+
+    hgsc_cache_close(&cache);
+}
+
+
+/*
+ *     Append one sample's --sample-major row to out_buf. codes holds its nsites 2-bit codes.
+ *     */
+void put_sample_row(int sample, const uint8_t *codes)
+{
+    uint64_t j;
+    if (format == FORMAT_CSV)
+    {
+        kputs(header->samples[sample], &out_buf);
+        kputc(',', &out_buf);
+        for (j = 0; j < nsites; j++)
         {
-            printf("0");
+            if (out_buf.l >= OUT_BLOCK)
+                flush_out();
+            if (ks_resize(&out_buf, out_buf.l + sizeof(tokens[0].s)) < 0)
+                error("Could not allocate the output buffer\n");
+            const token_t *token = &tokens[gt_code_of_2bit[(codes[j >> 2] >> (2 * (j & 3))) & 3]];
+            memcpy(out_buf.s + out_buf.l, token->s, sizeof(token->s));
+            out_buf.l += token->len;
         }
-        else if (all1 != all2)
+        out_buf.s[out_buf.l - 1] = '\n';  // the last comma, or the one after the name
+        return;
+    }
+
+    if (ks_resize(&out_buf, out_buf.l + matrix_header.row_bytes) < 0)
+        error("Could not allocate the output buffer\n");
+    char *row = out_buf.s + out_buf.l;
+    if (format == FORMAT_2BIT)
+    {
+        memcpy(row, codes, matrix_header.row_bytes);
+    }
+    else
+    {
+        for (j = 0; j < nsites; j++)
         {
-            printf("0.5");
+            int code = gt_code_of_2bit[(codes[j >> 2] >> (2 * (j & 3))) & 3];
+            if (format == FORMAT_INT8)
+                row[j] = codes_int8[code];
+            else
+                memcpy(row + j * sizeof(float), &codes_float32[code], sizeof(float));
         }
-        else if (all1 == all2)
+    }
+    out_buf.l += matrix_header.row_bytes;
+    if (out_buf.l >= OUT_BLOCK)
+        flush_out();
+}
+
+/*
+ *     Read the spilled blocks back a group of samples at a time and write out one row per sample. Every block but
+ *     the last holds a multiple of 4 sites, so a sample's pieces just need to be laid end to end.
+ *     */
+void write_sample_major(void)
+{
+    if (block_nsites > 0)
+        spill_block();
+
+    uint64_t j;
+    if (format == FORMAT_CSV)
+    {
+        kputs("sample", &out_buf);
+        const int32_t *site = (const int32_t *) sites.s;
+        for (j = 0; j < nsites; j++)
         {
-            printf("1");
+            ksprintf(&out_buf, ",%s:%d", bcf_hdr_id2name(header, site[2 * j]), site[2 * j + 1]);
+            if (out_buf.l >= OUT_BLOCK)
+                flush_out();
         }
-        else  // Something is terribly wrong, probably?
+        kputc('\n', &out_buf);
+    }
+    else
+    {
+        matrix_header.row_bytes = matrix_row_bytes(nsites);
+    }
+
+    size_t full_bytes = SITES_PER_BLOCK / 4;  // per sample, in every block but the last
+    size_t sample_bytes = (nsites + 3) / 4;
+    int group = sample_bytes > 0 && MERGE_MEMORY / sample_bytes < nsamples ? MERGE_MEMORY / sample_bytes : nsamples;
+    if (group < 1)
+        group = 1;
+
+    uint8_t *codes = malloc((size_t) group * sample_bytes + 1);
+    uint8_t *chunk = malloc((size_t) group * full_bytes + 1);
+    if (codes == NULL || chunk == NULL)
+        error("Could not allocate %zu bytes to read back the temporary file\n", (size_t) group * sample_bytes);
+
+    int g0, g, k;
+    for (g0 = 0; g0 < nsamples; g0 += group)
+    {
+        int ng = nsamples - g0 < group ? nsamples - g0 : group;
+        for (k = 0; k < nblocks; k++)
         {
-            printf("-100");
+            size_t block_bytes = k < nblocks - 1 ? full_bytes : sample_bytes - k * full_bytes;
+            off_t offset = (off_t) k * nsamples * full_bytes + (off_t) g0 * block_bytes;
+            if (fseeko(spill_fp, offset, SEEK_SET) != 0 || fread(chunk, block_bytes, ng, spill_fp) != ng)
+                error("Could not read back the temporary file in %s\n", temp_dir);
+            for (g = 0; g < ng; g++)
+                memcpy(codes + g * sample_bytes + k * full_bytes, chunk + g * block_bytes, block_bytes);
         }
-
-        if (i != nsamples - 1)
-            printf(",");
-        else
-            printf("\n");
+        for (g = 0; g < ng; g++)
+            put_sample_row(g0 + g, codes + g * sample_bytes);
     }
 
-    free(filter_data[0]);
-    free(filter_data);
-    free(gt_data);
-
-    return NULL;
+    free(codes);
+    free(chunk);
 }
 
 
@@ -120,5 +721,32 @@ bcf1_t *process(bcf1_t *rec)
  *     */
 void destroy(void)
 {
-}
+    hgsc_stats_lap(&stats, HGSC_PHASE_BCFTOOLS);
+    if (sample_major)
+    {
+        write_sample_major();
+        fclose(spill_fp);
+        free(block);
+        free(transposed);
+    }
+    if (format != FORMAT_CSV)
+        finish_matrix();
+    flush_out();
+    free(out_buf.s);
 
+    if (out_bgzf != NULL)
+    {
+        if (bgzf_close(out_bgzf) != 0)
+            error("Could not close %s\n", out_fname ? out_fname : "stdout");
+    }
+    else if (fflush(out_fp) != 0 || (out_fp != stdout && fclose(out_fp) != 0))
+    {
+        error("Could not close %s\n", out_fname);
+    }
+    hgsc_stats_lap(&stats, HGSC_PHASE_OUTPUT);
+
+    free(gt_codes);
+    free(sites.s);
+    hgsc_decode_destroy(&decode);
+    hgsc_stats_report(&stats);
+}
@@ -0,0 +1,473 @@
+/*
+ *     Micro-benchmark for the HGSC plugins. Generates a synthetic cohort with the GT, FT and DP fields the plugins
+ *     read, loads one plugin with dlopen() and times its init(), process() and destroy() in this process, the way
+ *     bcftools would call them. Reports records/s, genotypes/s, peak RSS and allocations per record.
+ *
+ *     The distinct records are generated once, written to a BCF and read back, so process() gets packed records just
+ *     like ones bcftools has read from a file. Each site is a fresh bcf_copy() of one of them; only the plugin calls
+ *     are timed. See README.md in this folder for how to build and run it.
+ *     */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <dlfcn.h>
+#include <sys/resource.h>
+#include <htslib/hts.h>
+#include <htslib/vcf.h>
+
+#define MAX_FT_VALUES 16
+
+typedef int (*init_f)(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out);
+typedef bcf1_t *(*process_f)(bcf1_t *rec);
+typedef void (*destroy_f)(void);
+
+typedef struct
+{
+    int nsamples;
+    long nsites;
+    int nalleles;  // REF + ALTs of every site
+    int ndistinct;  // distinct records to cycle through
+    double dp_mean;  // DP is Poisson around this
+    double dp_missing;  // fraction of DP values that are "."
+    double gt_missing;  // fraction of GT values that are ./.
+    char *ft_values[MAX_FT_VALUES];  // --ft: FT values and their weights
+    double ft_weights[MAX_FT_VALUES];
+    int nft;
+    uint64_t seed;
+    char *write_fname;  // --write: also save the whole synthetic input here, e.g. to run it through bcftools
+    char *output_fname;  // --output: keep what the plugin prints, instead of sending it to /dev/null
+} args_t;
+
+// Everything but error() and the allocation hooks is static: the benchmark is linked with -rdynamic so the plugin can
+// find error(), and anything else exported would take the place of the plugin's globals of the same name.
+static args_t args;
+static uint64_t rng_state;
+
+// Allocation counts. With glibc malloc() and friends are replaced below, so this counts the plugin's and htslib's calls
+// too; elsewhere it stays 0.
+static long n_allocs;
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+
+void *malloc(size_t size)
+{
+    __atomic_add_fetch(&n_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    __atomic_add_fetch(&n_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size)
+{
+    __atomic_add_fetch(&n_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(p, size);
+}
+#endif
+
+/*
+ *     The plugins report fatal errors through bcftools' error(), so the benchmark has to provide it too.
+ *     */
+void error(const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    vfprintf(stderr, format, ap);
+    va_end(ap);
+    exit(-1);
+}
+
+static const char *usage(void)
+{
+    return "Usage: HGSC_bench [OPTIONS] PLUGIN.so [-- PLUGIN_OPTIONS]\n"
+           "About:\n"
+           "\tTimes one plugin on a synthetic cohort. PLUGIN_OPTIONS are passed to the plugin's init().\n"
+           "Options:\n"
+           "\t-n, --samples N        number of samples [1000]\n"
+           "\t-s, --sites N          number of records [100000]\n"
+           "\t-a, --alleles N        alleles per site, REF included [2]\n"
+           "\t-f, --ft LIST          FT values and weights [PASS:60,.:20,No_var:15,low_cov:5]\n"
+           "\t-d, --dp MEAN          mean DP [30]\n"
+           "\t    --dp-missing F     fraction of DP values that are missing [0.01]\n"
+           "\t    --gt-missing F     fraction of GT values that are ./. [0.02]\n"
+           "\t-D, --distinct N       distinct records to cycle through [256]\n"
+           "\t-S, --seed N           random seed [1]\n"
+           "\t-w, --write FILE       also write the synthetic input to FILE as BCF\n"
+           "\t-o, --output FILE      write what the plugin prints to FILE instead of /dev/null\n"
+           "Examples:\n"
+           "\tHGSC_bench -n 10000 -s 20000 plugins/HGSC_sample_summary.so -- --both\n"
+           "\tHGSC_bench -n 2000 -a 3 plugins/HGSC_filt_w_dotdots.so -- 10\n";
+}
+
+// xorshift64*, so runs with the same --seed generate the same cohort everywhere
+static double rng_uniform(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return ((rng_state * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int rng_poisson(double mean)
+{
+    if (mean > 30)  // normal approximation; exp(-mean) would underflow for very deep coverage
+    {
+        double z = sqrt(-2 * log(1 - rng_uniform())) * cos(2 * M_PI * rng_uniform());
+        double x = mean + sqrt(mean) * z + 0.5;
+        return x < 0 ? 0 : (int) x;
+    }
+
+    double limit = exp(-mean), p = rng_uniform();
+    int k = 0;
+    while (p > limit)
+    {
+        p *= rng_uniform();
+        k++;
+    }
+    return k;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double peak_rss_mb(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024.0;  // kilobytes on Linux
+}
+
+/*
+ *     Parse --ft, e.g. "PASS:60,.:20,No_var:15,low_cov:5".
+ *     */
+static void parse_ft(const char *list)
+{
+    char *copy = strdup(list), *tok, *save = NULL;
+    args.nft = 0;
+    for (tok = strtok_r(copy, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save))
+    {
+        char *colon = strrchr(tok, ':');
+        if (colon == NULL || args.nft == MAX_FT_VALUES)
+            error("Could not parse --ft %s\n", list);
+        *colon = 0;
+        args.ft_values[args.nft] = strdup(tok);
+        args.ft_weights[args.nft] = atof(colon + 1);
+        args.nft++;
+    }
+    free(copy);
+}
+
+static bcf_hdr_t *make_header(void)
+{
+    bcf_hdr_t *hdr = bcf_hdr_init("w");
+    bcf_hdr_append(hdr, "##contig=<ID=chr1,length=248956422>");
+    bcf_hdr_append(hdr, "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">");
+    bcf_hdr_append(hdr, "##FORMAT=<ID=FT,Number=1,Type=String,Description=\"Genotype filter\">");
+    bcf_hdr_append(hdr, "##FORMAT=<ID=DP,Number=1,Type=Integer,Description=\"Read depth\">");
+
+    int i;
+    char name[32];
+    for (i = 0; i < args.nsamples; i++)
+    {
+        snprintf(name, sizeof(name), "S%d", i + 1);
+        bcf_hdr_add_sample(hdr, name);
+    }
+    if (bcf_hdr_sync(hdr) < 0)
+        error("Could not build the header\n");
+    return hdr;
+}
+
+/*
+ *     Fill rec with one synthetic site. Most sites are rare: the ALT frequency is a uniform draw cubed.
+ *     */
+static void make_record(bcf_hdr_t *hdr, bcf1_t *rec, int pos, int32_t *gt, int32_t *dp, const char **ft)
+{
+    static const char *bases = "ACGT";
+    char alleles[64];
+    int i, j, len = 0;
+    for (i = 0; i < args.nalleles; i++)
+    {
+        if (i > 0)
+            alleles[len++] = ',';
+        // REF is one base; ALTs beyond the other three bases become insertions
+        alleles[len++] = bases[i % 4];
+        for (j = 0; j < i / 4; j++)
+            alleles[len++] = bases[(i + j) % 4];
+    }
+    alleles[len] = 0;
+
+    double alt_freq = pow(rng_uniform(), 3);
+    double ft_total = 0;
+    for (j = 0; j < args.nft; j++)
+        ft_total += args.ft_weights[j];
+
+    for (i = 0; i < args.nsamples; i++)
+    {
+        if (rng_uniform() < args.gt_missing)
+        {
+            gt[2*i + 0] = gt[2*i + 1] = bcf_gt_missing;
+        }
+        else
+        {
+            for (j = 0; j < 2; j++)
+            {
+                int allele = 0;
+                if (args.nalleles > 1 && rng_uniform() < alt_freq)
+                    allele = 1 + (int) (rng_uniform() * (args.nalleles - 1));
+                gt[2*i + j] = bcf_gt_unphased(allele);
+            }
+        }
+
+        dp[i] = rng_uniform() < args.dp_missing ? bcf_int32_missing : rng_poisson(args.dp_mean);
+
+        double pick = rng_uniform() * ft_total;
+        for (j = 0; j < args.nft - 1 && pick >= args.ft_weights[j]; j++)
+            pick -= args.ft_weights[j];
+        ft[i] = args.ft_values[j];
+    }
+
+    bcf_clear(rec);
+    rec->rid = 0;
+    rec->pos = pos;
+    bcf_update_alleles_str(hdr, rec, alleles);
+    bcf_update_genotypes(hdr, rec, gt, 2 * args.nsamples);
+    bcf_update_format_string(hdr, rec, "FT", ft, args.nsamples);
+    bcf_update_format_int32(hdr, rec, "DP", dp, args.nsamples);
+}
+
+/*
+ *     Generate the distinct records, then write them out and read them back so they are packed the way records read
+ *     from a file are.
+ *     */
+static bcf1_t **make_records(bcf_hdr_t *hdr)
+{
+    char fname[] = "/tmp/HGSC_bench_XXXXXX";
+    int fd = mkstemp(fname);
+    if (fd < 0)
+        error("Could not create a temporary file\n");
+    close(fd);
+
+    int32_t *gt = malloc(2 * args.nsamples * sizeof(int32_t));
+    int32_t *dp = malloc(args.nsamples * sizeof(int32_t));
+    const char **ft = malloc(args.nsamples * sizeof(char *));
+    bcf1_t *rec = bcf_init();
+    htsFile *fp = hts_open(fname, "wbu");
+    if (gt == NULL || dp == NULL || ft == NULL || fp == NULL || bcf_hdr_write(fp, hdr) < 0)
+        error("Could not write %s\n", fname);
+
+    int i;
+    for (i = 0; i < args.ndistinct; i++)
+    {
+        make_record(hdr, rec, i, gt, dp, ft);
+        if (bcf_write(fp, hdr, rec) < 0)
+            error("Could not write %s\n", fname);
+    }
+    hts_close(fp);
+    bcf_destroy(rec);
+    free(gt);
+    free(dp);
+    free(ft);
+
+    bcf1_t **records = malloc(args.ndistinct * sizeof(bcf1_t *));
+    fp = hts_open(fname, "rb");
+    bcf_hdr_t *file_hdr = fp != NULL ? bcf_hdr_read(fp) : NULL;
+    if (records == NULL || file_hdr == NULL)
+        error("Could not read back %s\n", fname);
+    for (i = 0; i < args.ndistinct; i++)
+    {
+        records[i] = bcf_init();
+        if (bcf_read(fp, file_hdr, records[i]) < 0)
+            error("Could not read back %s\n", fname);
+    }
+    bcf_hdr_destroy(file_hdr);
+    hts_close(fp);
+    unlink(fname);
+    return records;
+}
+
+/*
+ *     --write: the whole synthetic input, cycling through the distinct records.
+ *     */
+static void write_input(bcf_hdr_t *hdr, bcf1_t **records)
+{
+    htsFile *fp = hts_open(args.write_fname, "wb");
+    if (fp == NULL || bcf_hdr_write(fp, hdr) < 0)
+        error("Could not write %s\n", args.write_fname);
+
+    bcf1_t *rec = bcf_init();
+    long i;
+    for (i = 0; i < args.nsites; i++)
+    {
+        bcf_copy(rec, records[i % args.ndistinct]);
+        rec->pos = i;
+        if (bcf_write(fp, hdr, rec) < 0)
+            error("Could not write %s\n", args.write_fname);
+    }
+    bcf_destroy(rec);
+    if (hts_close(fp) != 0)
+        error("Could not close %s\n", args.write_fname);
+}
+
+int main(int argc, char **argv)
+{
+    args.nsamples = 1000;
+    args.nsites = 100000;
+    args.nalleles = 2;
+    args.ndistinct = 256;
+    args.dp_mean = 30;
+    args.dp_missing = 0.01;
+    args.gt_missing = 0.02;
+    args.seed = 1;
+    args.write_fname = NULL;
+    args.output_fname = NULL;
+    parse_ft("PASS:60,.:20,No_var:15,low_cov:5");
+
+    static struct option long_options[] =
+    {
+        {"help", no_argument, NULL, 'h'},
+        {"samples", required_argument, NULL, 'n'},
+        {"sites", required_argument, NULL, 's'},
+        {"alleles", required_argument, NULL, 'a'},
+        {"ft", required_argument, NULL, 'f'},
+        {"dp", required_argument, NULL, 'd'},
+        {"dp-missing", required_argument, NULL, 1},
+        {"gt-missing", required_argument, NULL, 2},
+        {"distinct", required_argument, NULL, 'D'},
+        {"seed", required_argument, NULL, 'S'},
+        {"write", required_argument, NULL, 'w'},
+        {"output", required_argument, NULL, 'o'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    // "+" stops at PLUGIN.so, so the plugin's own options are left alone
+    while ((opt = getopt_long(argc, argv, "+hn:s:a:f:d:D:S:w:o:", long_options, NULL)) >= 0)
+    {
+        switch (opt)
+        {
+            case 'n': args.nsamples = atoi(optarg); break;
+            case 's': args.nsites = atol(optarg); break;
+            case 'a': args.nalleles = atoi(optarg); break;
+            case 'f': parse_ft(optarg); break;
+            case 'd': args.dp_mean = atof(optarg); break;
+            case 1: args.dp_missing = atof(optarg); break;
+            case 2: args.gt_missing = atof(optarg); break;
+            case 'D': args.ndistinct = atoi(optarg); break;
+            case 'S': args.seed = strtoull(optarg, NULL, 10); break;
+            case 'w': args.write_fname = optarg; break;
+            case 'o': args.output_fname = optarg; break;
+            default: error("%s", usage()); break;
+        }
+    }
+    if (optind == argc || args.nsamples < 1 || args.nsites < 1 || args.nalleles < 1 || args.nalleles > 16
+        || args.ndistinct < 1 || args.nft < 1)
+        error("%s", usage());
+    rng_state = args.seed * 0x9E3779B97F4A7C15ULL + 1;
+
+    char *plugin_fname = argv[optind++];
+    if (optind < argc && strcmp(argv[optind], "--") == 0)
+        optind++;
+
+    void *plugin = dlopen(plugin_fname, RTLD_NOW);
+    if (plugin == NULL)
+        error("Could not load %s: %s\n", plugin_fname, dlerror());
+    init_f plugin_init = (init_f) dlsym(plugin, "init");
+    process_f plugin_process = (process_f) dlsym(plugin, "process");
+    destroy_f plugin_destroy = (destroy_f) dlsym(plugin, "destroy");
+    if (plugin_init == NULL || plugin_process == NULL || plugin_destroy == NULL)
+        error("%s is not a bcftools plugin\n", plugin_fname);
+
+    // the plugin sees its name and then its options, as under bcftools
+    int plugin_argc = argc - optind + 1;
+    char **plugin_argv = malloc((plugin_argc + 1) * sizeof(char *));
+    plugin_argv[0] = plugin_fname;
+    memcpy(plugin_argv + 1, argv + optind, (argc - optind) * sizeof(char *));
+    plugin_argv[plugin_argc] = NULL;
+
+    double t = now();
+    bcf_hdr_t *hdr = make_header();
+    bcf1_t **records = make_records(hdr);
+    fprintf(stderr, "Generated %d distinct records of %d samples in %.2fs\n", args.ndistinct, args.nsamples, now() - t);
+    if (args.write_fname != NULL)
+        write_input(hdr, records);
+
+    // what the plugin prints goes to /dev/null (or --output) so terminal speed doesn't count
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int out_fd = open(args.output_fname != NULL ? args.output_fname : "/dev/null", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (saved_stdout < 0 || out_fd < 0 || dup2(out_fd, STDOUT_FILENO) < 0)
+        error("Could not redirect the plugin's output\n");
+    close(out_fd);
+
+    double rss_before = peak_rss_mb();
+    bcf_hdr_t *hdr_out = bcf_hdr_dup(hdr);
+    bcf1_t *rec = bcf_init();
+
+    long allocs = n_allocs;
+    t = now();
+    optind = 0;  // the plugin parses its options with getopt too
+    if (plugin_init(plugin_argc, plugin_argv, hdr, hdr_out) < 0)
+        error("%s failed to initialize\n", plugin_fname);
+    double init_time = now() - t;
+    long init_allocs = n_allocs - allocs;
+
+    double process_time = 0;
+    long process_allocs = 0;
+    long i;
+    for (i = 0; i < args.nsites; i++)
+    {
+        bcf_copy(rec, records[i % args.ndistinct]);
+        rec->pos = i;
+
+        allocs = n_allocs;
+        t = now();
+        plugin_process(rec);
+        process_time += now() - t;
+        process_allocs += n_allocs - allocs;
+    }
+
+    allocs = n_allocs;
+    t = now();
+    plugin_destroy();  // the threaded plugins finish their last batches here
+    double destroy_time = now() - t;
+    long destroy_allocs = n_allocs - allocs;
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+
+    double total = process_time + destroy_time;
+    printf("plugin\t%s\n", plugin_fname);
+    printf("samples\t%d\nsites\t%ld\nalleles\t%d\n", args.nsamples, args.nsites, args.nalleles);
+    printf("init_s\t%.4f\nprocess_s\t%.4f\ndestroy_s\t%.4f\n", init_time, process_time, destroy_time);
+    printf("records_per_s\t%.0f\n", args.nsites / total);
+    printf("genotypes_per_s\t%.0f\n", (double) args.nsites * args.nsamples / total);
+    printf("peak_rss_mb\t%.1f\n", peak_rss_mb());
+    printf("rss_before_init_mb\t%.1f\n", rss_before);
+    printf("allocs_init\t%ld\n", init_allocs);
+    printf("allocs_per_record\t%.3f\n", process_allocs / (double) args.nsites);
+    printf("allocs_destroy\t%ld\n", destroy_allocs);
+
+    bcf_destroy(rec);
+    for (i = 0; i < args.ndistinct; i++)
+        bcf_destroy(records[i]);
+    free(records);
+    free(plugin_argv);
+    return 0;
+}
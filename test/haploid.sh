@@ -0,0 +1,78 @@
+#!/bin/sh
+# Checks that every plugin reads a haploid call as if both alleles were the one it has, i.e. "1" as 1/1 (a hemizygous
+# ALT is homvar with full dosage), "0" as 0/0 and "." as ./., both in a haploid record (chrX 100) and in a diploid
+# record where some samples are haploid and padded with vector_end (chrX 200 and 300). There are 9 samples, so the
+# padded record goes through a whole SSE4.1/AVX2 block of the append_gtcounts kernel as well as its scalar tail.
+#
+# Run from the top of the repository with the plugins built:
+#
+#     BCFTOOLS_PLUGINS=/path/to/bcftools/plugins sh test/haploid.sh
+#
+# BCFTOOLS picks the bcftools binary, bcftools on the PATH by default.
+
+BCFTOOLS=${BCFTOOLS:-bcftools}
+VCF=$(dirname "$0")/haploid.vcf
+TMP=${TMPDIR:-/tmp}/hgsc_haploid.$$
+mkdir -p "$TMP" || exit 1
+trap 'rm -rf "$TMP"' EXIT
+failed=0
+
+# expect NAME EXPECTED ACTUAL
+expect()
+{
+    if [ "$2" != "$3" ]; then
+        printf 'FAIL %s\n  expected: %s\n  got:      %s\n' "$1" "$2" "$3"
+        failed=1
+    fi
+}
+
+# site FILE POS: the INFO column of the record at POS
+site()
+{
+    grep -v '^#' "$1" | awk -v pos="$2" '$2 == pos { print $8 }'
+}
+
+# sample columns of the record at POS
+samples()
+{
+    grep -v '^#' "$1" | awk -v pos="$2" '$2 == pos { s = $10; for (i = 11; i <= NF; i++) s = s " " $i; print s }'
+}
+
+"$BCFTOOLS" +HGSC_append_gtcounts "$VCF" > "$TMP/gtc.vcf" || exit 1
+expect "gtcounts haploid" "PASS_.._9=1;PASS_00_9=4;PASS_11_9=4" "$(site "$TMP/gtc.vcf" 100)"
+expect "gtcounts padded" "PASS_.._9=1;PASS_00_9=3;PASS_01_9=1;PASS_11_9=4" "$(site "$TMP/gtc.vcf" 200)"
+
+"$BCFTOOLS" +HGSC_append_gtcounts "$VCF" -- --sparse > "$TMP/sparse.vcf" || exit 1
+expect "gtcounts --sparse haploid" "GTC_KEYS_9=PASS_./.,PASS_0/0,PASS_1/1;GTC_COUNTS_9=1,4,4" "$(site "$TMP/sparse.vcf" 100)"
+expect "gtcounts --sparse padded" "GTC_KEYS_9=PASS_./.,PASS_0/0,PASS_0/1,PASS_1/1;GTC_COUNTS_9=1,3,1,4" \
+    "$(site "$TMP/sparse.vcf" 200)"
+
+"$BCFTOOLS" +HGSC_filt_w_dotdots "$VCF" 10 > "$TMP/filt.vcf" || exit 1
+expect "filt_w_dotdots" ".:No_data:2 1:PASS:20 0:No_var:20 .:No_data:20 ./.:No_data:2 0/1:PASS:20 1:PASS:2 0:No_var:20 .:No_data:2" \
+    "$(samples "$TMP/filt.vcf" 300)"
+
+"$BCFTOOLS" +HGSC_append_gtcounts "$VCF" -- --min-depth 10 > "$TMP/gtc_dp.vcf" || exit 1
+expect "gtcounts --min-depth" "PASS_01_9=1;PASS_11_9=2;NVAR_00_9=2;NDAT_.._9=4" "$(site "$TMP/gtc_dp.vcf" 300)"
+
+"$BCFTOOLS" +HGSC_sample_summary "$VCF" -- --ibs "$TMP/ibs.csv" > "$TMP/ss.tsv" || exit 1
+expect "sample_summary" "S2,3,3,inf,0,1,2,0,0.500000,0.000000,13.333333,40,3" "$(grep '^S2,' "$TMP/ss.tsv")"
+expect "sample_summary --ibs" "S1,S8,3,0,1,2,0.333333" "$(grep '^S1,S8,' "$TMP/ibs.csv")"
+
+"$BCFTOOLS" +HGSC_variant_summary "$VCF" > "$TMP/vs.csv" || exit 1
+expect "variant_summary haploid" "chrX,100,4,0,4,0,0,0,1,0.500000,False" "$(grep '^chrX,100,' "$TMP/vs.csv")"
+expect "variant_summary padded" "chrX,200,3,1,4,0,0,0,1,0.562500,False" "$(grep '^chrX,200,' "$TMP/vs.csv")"
+
+"$BCFTOOLS" +HGSC_vcf2csv "$VCF" > "$TMP/gt.csv" || exit 1
+expect "vcf2csv haploid" "0,1,1,-10,0,1,0,0,1" "$(sed -n 3p "$TMP/gt.csv")"
+
+# The cache must store haploid calls the same way, so the summaries give the same output from it
+grep '^#' "$VCF" > "$TMP/header.vcf"
+"$BCFTOOLS" +HGSC_build_cache "$VCF" -- --output "$TMP/haploid.gtc" > /dev/null || exit 1
+for plugin in HGSC_sample_summary HGSC_variant_summary HGSC_vcf2csv; do
+    "$BCFTOOLS" +$plugin "$VCF" > "$TMP/direct.txt" || exit 1
+    "$BCFTOOLS" +$plugin "$TMP/header.vcf" -- --from-cache "$TMP/haploid.gtc" > "$TMP/cached.txt" || exit 1
+    cmp -s "$TMP/direct.txt" "$TMP/cached.txt" || { echo "FAIL $plugin --from-cache"; failed=1; }
+done
+
+[ $failed = 0 ] && echo "haploid: ok"
+exit $failed
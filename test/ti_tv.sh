@@ -0,0 +1,38 @@
+#!/bin/sh
+# Checks that HGSC_sample_summary takes the ALT of a het from the allele that isn't REF, whichever order GT lists them
+# in. Each sample has the same three hets, a transition, a transversion and a transition to the second ALT, written
+# 1/0 and 2/0 (S1), 0/1 and 0/2 (S2) and phased (S3), so every sample has ti_tv_ratio 2, also from a cache.
+#
+# Run from the top of the repository with the plugins built:
+#
+#     BCFTOOLS_PLUGINS=/path/to/bcftools/plugins sh test/ti_tv.sh
+#
+# BCFTOOLS picks the bcftools binary, bcftools on the PATH by default.
+
+BCFTOOLS=${BCFTOOLS:-bcftools}
+VCF=$(dirname "$0")/ti_tv.vcf
+TMP=${TMPDIR:-/tmp}/hgsc_ti_tv.$$
+mkdir -p "$TMP" || exit 1
+trap 'rm -rf "$TMP"' EXIT
+failed=0
+
+# check FILE: every sample's ti_tv_ratio in FILE is 2
+check()
+{
+    bad=$(awk -F, 'NR > 1 && $4 != "2.000000" { print $1 "=" $4 }' "$1")
+    if [ -n "$bad" ] || [ "$(wc -l < "$1")" -ne 4 ]; then
+        echo "FAIL $2: ti_tv_ratio not 2.000000 for" $bad
+        failed=1
+    fi
+}
+
+"$BCFTOOLS" +HGSC_sample_summary "$VCF" > "$TMP/ss.tsv" || exit 1
+check "$TMP/ss.tsv" "sample_summary"
+
+grep '^#' "$VCF" > "$TMP/header.vcf"
+"$BCFTOOLS" +HGSC_build_cache "$VCF" -- --output "$TMP/ti_tv.gtc" > /dev/null || exit 1
+"$BCFTOOLS" +HGSC_sample_summary "$TMP/header.vcf" -- --from-cache "$TMP/ti_tv.gtc" > "$TMP/cached.tsv" || exit 1
+check "$TMP/cached.tsv" "sample_summary --from-cache"
+
+[ $failed = 0 ] && echo "ti_tv: ok"
+exit $failed